@@ -2,9 +2,10 @@
 
 #include "geometry.hpp"
 #include "index_types.hpp"
+#include "leaf_tris.hpp"
 #include "mesh.hpp"
+#include "utility/binary_cache.hpp"
 #include "utility/numeric.hpp"
-#include "utility/permuted_span.hpp"
 #include "utility/span.hpp"
 
 #include <algorithm>
@@ -13,274 +14,700 @@
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <execution>
+#include <memory>
 #include <optional>
 #include <vector>
 
 #include <glm/vec3.hpp>
 
 
-// Represents an intersection of a line and mesh.
-struct LineMeshIntersection {
-    float t;                    // Line equation parameter.
-    float pointCoord2;          // Barycentric coordinate relative to vertex 2.
-    float pointCoord3;          // Barycentric coordinate relative to vertex 3.
-    glm::vec3 point;            // Intersection point.
-    MeshTriIndex meshTriIndex;  // Index of intersected mesh + tri.
-};
-
-
-// Binary space partitioning structure for line-mesh intersections.
+// Binary space partitioning structure for line-mesh intersections, for a single mesh.
 class BSPTree {
 public:
-    BSPTree(Span<glm::vec3 const> vertexPositions, Span<VertexRange const> vertexRanges,
-            Span<IndexedTri const> tris, PermutedSpan<TriRange const, MeshIndex> triRanges,
-            Span<PreprocessedTri const> preprocessedTris, Span<TriRange const> preprocessedTriRanges,
-            BoundingBox const& box) :
-        _root{}, _inodes{}, _leaves{}
+    BSPTree(Span<glm::vec3 const> vertexPositions, Span<IndexedTri const> tris,
+            Span<PreprocessedTri const> preprocessedTris) :
+        _box{}, _root{}, _nodeStorage{}, _triBlockStorage{}, _nodes{}, _triBlocks{}
     {
-        auto const approxLeaves = (preprocessedTris.size() + Leaf::MAX_TRIS - 1) / Leaf::MAX_TRIS;
-        _leaves.reserve(approxLeaves);
-        auto const approxInodes = std::max<std::size_t>(approxLeaves, 1) - 1;
-        _inodes.reserve(approxInodes);
+        assert(tris.size() == preprocessedTris.size());
+
+        auto const approxLeaves = (preprocessedTris.size() + MAX_LEAF_TRIS - 1) / MAX_LEAF_TRIS;
+        _triBlockStorage.reserve(approxLeaves * MAX_LEAF_TRI_BLOCKS);
+        // Every node but the root has a sibling.
+        auto const approxNodes = 2 * (std::max<std::size_t>(approxLeaves, 1) - 1);
+        _nodeStorage.reserve(approxNodes);
+
+        // Expand box slightly to account for FP error when handling surfaces right on the edge of the box.
+        _box = computeBoundingBox(vertexPositions);
+        _box.min -= BOX_TOLERANCE;
+        _box.max += BOX_TOLERANCE;
+
+        BuildTris buildTris{{}, preprocessedTris};
+        buildTris.tris.reserve(tris.size());
+        std::vector<TriReference> references;
+        references.reserve(tris.size());
+        auto const triCount = intCast<TriIndex>(tris.size());
+        for (TriIndex triIndex = 0; triIndex < triCount; ++triIndex) {
+            auto const& meshTri = tris[triIndex];
+            Tri const tri{vertexPositions[meshTri.v1], vertexPositions[meshTri.v2], vertexPositions[meshTri.v3]};
+            buildTris.tris.push_back(tri);
+            references.push_back({triIndex, computeBoundingBox(tri)});
+        }
+
+        BuildTask rootTask;
+        rootTask.root = _createNode(buildTris, Span{references}, _box, rootTask, 0, _depthLimit(tris.size()), 0);
+        _root = _stitchBuildTask(rootTask);
+        _nodes = readOnlySpan(_nodeStorage);
+        _triBlocks = readOnlySpan(_triBlockStorage);
+    }
+
+    // Creates a tree viewing data written by write(), which must outlive the tree.
+    static BSPTree read(CacheReader& reader) {
+        auto const box = reader.read<BoundingBox>();
+        auto const root = reader.read<Node>();
+        auto const nodes = reader.readArray<Node>();
+        auto const triBlocks = reader.readArray<LeafTriBlock>();
+        return BSPTree{box, root, nodes, triBlocks};
+    }
 
-        _root = _createNode(vertexPositions, vertexRanges, tris, triRanges, preprocessedTris, preprocessedTriRanges,
-            box, _inodes, _leaves, 0);
+    // The tree may view its own storage, so copies would be invalid.
+    BSPTree(BSPTree const&) = delete;
+    BSPTree(BSPTree&&) = default;
+    BSPTree& operator=(BSPTree const&) = delete;
+    BSPTree& operator=(BSPTree&&) = default;
+
+    BoundingBox const& box() const {
+        return _box;
+    }
+
+    void write(CacheWriter& writer) const {
+        writer.write(_box);
+        writer.write(_root);
+        writer.writeArray(_nodes);
+        writer.writeArray(_triBlocks);
     }
 
+    // Finds the nearest intersection with line parameter in [tMin, tMax].
     template<SurfaceConsideration Surfaces>
-    std::optional<LineMeshIntersection> lineTriNearestIntersection(Line const& line, float tMin) const {
-        struct Traverser {
-            Line const& line;
-            Span<INode const> inodes;
-            Span<Leaf const> leaves;
-            float tMin;
-
-            std::optional<LineMeshIntersection> visitLeaf(BoundingBox const& box, Leaf const& leaf) const {
-                assert(leaf.triCount > 0);
-
-                std::array<LineTrisIntersection, Leaf::MAX_TRI_BLOCKS> intersections;
-                auto const blockCount = (leaf.triCount + 7u) / 8u;
-                for (unsigned i = 0; ;) {
-                    intersections[i] = lineTrisIntersection<Surfaces>(line, leaf.tris[i]);
-                    ++i;
-                    if (i >= blockCount) {
-                        break;
-                    }
+    std::optional<LineTriIntersection> lineTriNearestIntersection(Line const& line, float tMin, float tMax) const {
+        // Nodes are visited front to back, each with the range of line parameters within the node. Tris may extend
+        // outside the leaves containing them, so the nearest intersection found so far is carried through the
+        // traversal, and is only known to be the nearest once it is within the current leaf.
+        // A tri in multiple leaves may be tested more than once per line, but as traversal stops at the first leaf
+        // containing an intersection, this is rare (under 5% of tri tests even for many large overlapping tris), so
+        // recording tested tris per line ("mailboxing") costs more than it saves.
+        auto const preprocessedLine = preprocessLine(line);
+        auto const interval = lineBoxIntersection(preprocessedLine, _box, tMin, tMax);
+        if (interval.empty()) {
+            return std::nullopt;
+        }
+
+        std::optional<LineTriIntersection> nearestIntersection;
+        std::array<TraversalEntry, MAX_DEPTH> stack;
+        std::size_t stackSize = 0;
+        TraversalEntry current{_root, interval.entry, interval.exit};
+        while (true) {
+            if (current.node.isInode()) {
+                _traverseInode(line, preprocessedLine, current, stack, stackSize);
+                continue;
+            }
+            if (!current.node.isEmptyLeaf()) {
+                leafNearestIntersection<Surfaces>(line, _triBlocks.data() + current.node.firstTriBlock(),
+                    current.node.triCount(), tMin, tMax, nearestIntersection);
+                if (nearestIntersection && nearestIntersection->t <= current.tExit) {
+                    break;
                 }
+            }
+            // Else empty leaf.
+            if (stackSize == 0) {
+                break;
+            }
+            current = stack[--stackSize];
+            // Nodes are popped in order of line parameter, so no remaining node can have a nearer intersection.
+            if (nearestIntersection && nearestIntersection->t < current.tEntry) {
+                break;
+            }
+        }
+        return nearestIntersection;
+    }
 
-                LineMeshIntersection nearestIntersection{INFINITY};
-                bool hasIntersection = false;
-                for (unsigned triIndex = 0; ;) {
-                    auto const blockIndex = triIndex / 8;
-                    auto const i = triIndex % 8;
-                    auto const& blockIntersections = intersections[blockIndex];
-                    if (blockIntersections.exists[i]) {
-                        auto const t = blockIntersections.t[i];
-                        if (t < nearestIntersection.t && t >= tMin) {
-                            auto const point = line(t);
-                            auto const inBox = point.x >= box.min.x && point.x <= box.max.x
-                                            && point.y >= box.min.y && point.y <= box.max.y
-                                            && point.z >= box.min.z && point.z <= box.max.z;
-                            if (inBox) {
-                                nearestIntersection = {
-                                    t, blockIntersections.pointCoord2[i],
-                                    blockIntersections.pointCoord3[i],
-                                    point, leaf.triIndices[triIndex]};
-                                hasIntersection = true;
+    // Finds the nearest intersection of each line of a packet, with line parameter in [tMin, tMaxs[i]] for line i.
+    // The lines are traversed together, sharing node loads and division plane tests, which is faster than tracing them
+    // separately when they take similar paths through the tree. As the lines share an origin, they visit the children
+    // of an inode in the same order.
+    template<SurfaceConsideration Surfaces>
+    std::array<std::optional<LineTriIntersection>, LINE_PACKET_SIZE> lineTriNearestIntersections(
+            LinePacket const& lines, float tMin, FVec8 tMaxs) const {
+        std::array<std::optional<LineTriIntersection>, LINE_PACKET_SIZE> nearestIntersections;
+        auto const preprocessedLines = preprocessLinePacket(lines);
+        auto const intervals = linePacketBoxIntersection(preprocessedLines, _box, FVec8{tMin}, tMaxs);
+        if (intervals.nonEmpty() == 0) {
+            return nearestIntersections;
+        }
+
+        // Same as for single lines, per line of the packet. Lines which have found their nearest intersection are
+        // "done". A node is visited if any line which isn't done passes through it.
+        constexpr unsigned ALL_LINES = (1u << LINE_PACKET_SIZE) - 1;
+        FVec8 nearestTs{INFINITY};
+        unsigned done = 0;
+        std::array<PacketTraversalEntry, MAX_DEPTH> stack;
+        std::size_t stackSize = 0;
+        PacketTraversalEntry current{_root, intervals.entry, intervals.exit};
+        while (true) {
+            auto const active = bitmask(current.tEntry <= current.tExit) & ~done;
+            if (active != 0) {
+                if (current.node.isInode()) {
+                    _traversePacketInode(lines, preprocessedLines, active, current, stack, stackSize);
+                    continue;
+                }
+                if (!current.node.isEmptyLeaf()) {
+                    for (unsigned i = 0; i < LINE_PACKET_SIZE; ++i) {
+                        if (active & (1u << i)) {
+                            auto& nearestIntersection = nearestIntersections[i];
+                            leafNearestIntersection<Surfaces>(lines.line(i),
+                                _triBlocks.data() + current.node.firstTriBlock(), current.node.triCount(), tMin,
+                                tMaxs[i], nearestIntersection);
+                            if (nearestIntersection) {
+                                nearestTs[i] = nearestIntersection->t;
                             }
                         }
                     }
-                    ++triIndex;
-                    if (triIndex >= leaf.triCount) {
+                    done |= bitmask(nearestTs <= current.tExit) & active;
+                    if (done == ALL_LINES) {
                         break;
                     }
                 }
-                if (hasIntersection) {
-                    return {nearestIntersection};
-                }
-                else {
-                    return std::nullopt;
-                }
             }
+            if (stackSize == 0) {
+                break;
+            }
+            current = stack[--stackSize];
+            done |= bitmask(nearestTs < current.tEntry) & bitmask(current.tEntry <= current.tExit);
+        }
+        return nearestIntersections;
+    }
 
-            std::optional<LineMeshIntersection> visitNode(Node const& node) const {
-                if (lineIntersectsBox(line, node.box)) {
-                    if (node.index > 0) {
-                        return visitInode(inodes[node.index - 1]);
-                    }
-                    else if (node.index < 0) {
-                        return visitLeaf(node.box, leaves[-(node.index + 1)]);
-                    }
-                    // Else empty leaf.
+    // Checks if a line intersects any tri with line parameter in [tMin, tMax].
+    // Faster than finding the nearest intersection, as traversal stops at the first intersection found.
+    template<SurfaceConsideration Surfaces>
+    bool occluded(Line const& line, float tMin, float tMax) const {
+        auto const preprocessedLine = preprocessLine(line);
+        auto const interval = lineBoxIntersection(preprocessedLine, _box, tMin, tMax);
+        if (interval.empty()) {
+            return false;
+        }
+
+        std::array<TraversalEntry, MAX_DEPTH> stack;
+        std::size_t stackSize = 0;
+        TraversalEntry current{_root, interval.entry, interval.exit};
+        while (true) {
+            if (current.node.isInode()) {
+                _traverseInode(line, preprocessedLine, current, stack, stackSize);
+                continue;
+            }
+            if (!current.node.isEmptyLeaf()) {
+                if (leafOccluded<Surfaces>(line, _triBlocks.data() + current.node.firstTriBlock(), current.node.triCount(),
+                        tMin, tMax)) {
+                    return true;
                 }
-                return std::nullopt;
             }
+            // Else empty leaf.
+            if (stackSize == 0) {
+                return false;
+            }
+            current = stack[--stackSize];
+        }
+    }
 
-            std::optional<LineMeshIntersection> visitInode(INode const& inode) const {
-                float planeToLineOrigin = 0.0f;
-                assert(inode.divisionAxis < 3);
-                switch (inode.divisionAxis) {
-                case 0:
-                    planeToLineOrigin = line.origin.x - inode.positiveChild.box.min.x;
-                    break;
-                case 1:
-                    planeToLineOrigin = line.origin.y - inode.positiveChild.box.min.y;
-                    break;
-                case 2:
-                    planeToLineOrigin = line.origin.z - inode.positiveChild.box.min.z;
-                    break;
-                }
-                auto const positiveNear = planeToLineOrigin >= 0.0f;
+private:
+    // Inode or leaf, packed into 8 bytes so several nodes share a cache line.
+    // The children of an inode are stored adjacently, negative child first, and nodes are stored in depth-first
+    // order. Child boxes aren't stored, as traversal only needs the range of line parameters within each node, which
+    // is found from the division plane.
+    class Node {
+    public:
+        Node() = default;
 
-                auto const& nearChild = positiveNear ? inode.positiveChild : inode.negativeChild;
-                if (auto const intersection = visitNode(nearChild)) {
-                    return intersection;
-                }
-                auto const& farChild = !positiveNear ? inode.positiveChild : inode.negativeChild;
-                return visitNode(farChild);
+        static Node inode(std::uint8_t divisionAxis, float divisionPosition, std::size_t children) {
+            assert(divisionAxis < 3);
+            assert(children < (std::size_t{1} << 30));
+            return {divisionPosition, static_cast<std::uint32_t>(children << 2) | divisionAxis};
+        }
+
+        static Node leaf(std::size_t firstTriBlock, std::uint32_t triCount) {
+            assert(firstTriBlock < (std::size_t{1} << 30));
+            Node node{0.0f, static_cast<std::uint32_t>(firstTriBlock << 2) | LEAF_TAG};
+            node._triCount = triCount;
+            return node;
+        }
+
+        static Node emptyLeaf() {
+            return leaf(0, 0);
+        }
+
+        bool isInode() const {
+            return (_data & 3u) != LEAF_TAG;
+        }
+
+        bool isEmptyLeaf() const {
+            return !isInode() && _triCount == 0;
+        }
+
+        // 0 (X), 1 (Y), 2 (Z)
+        std::uint8_t divisionAxis() const {
+            assert(isInode());
+            return static_cast<std::uint8_t>(_data & 3u);
+        }
+
+        float divisionPosition() const {
+            assert(isInode());
+            return _divisionPosition;
+        }
+
+        // Index of the negative child. The positive child follows it.
+        std::size_t children() const {
+            assert(isInode());
+            return _data >> 2;
+        }
+
+        // Index of the leaf's first tri block.
+        std::size_t firstTriBlock() const {
+            assert(!isInode());
+            return _data >> 2;
+        }
+
+        std::uint32_t triCount() const {
+            assert(!isInode());
+            return _triCount;
+        }
+
+        // Adjusts the indices for when the nodes and tri blocks of a subtree are moved to a different position.
+        Node offset(std::size_t nodeOffset, std::size_t triBlockOffset) const {
+            if (isInode()) {
+                return inode(divisionAxis(), _divisionPosition, children() + nodeOffset);
+            }
+            else if (!isEmptyLeaf()) {
+                return leaf(firstTriBlock() + triBlockOffset, _triCount);
             }
+            else {
+                return *this;
+            }
+        }
+
+    private:
+        constexpr inline static std::uint32_t LEAF_TAG = 3;
+
+        union {
+            float _divisionPosition;        // Inode.
+            std::uint32_t _triCount;        // Leaf.
         };
+        std::uint32_t _data;    // Low 2 bits: division axis, or LEAF_TAG.
+                                // High 30 bits: inode: index of children.
+                                //               leaf: index of first tri block.
+
+        Node(float divisionPosition, std::uint32_t data) :
+            _divisionPosition{divisionPosition}, _data{data}
+        {}
+    };
+
+    static_assert(sizeof(Node) == 8);
+
+    // Leaves only occupy as many tri blocks as they need, but their size is still limited to keep leaf intersection
+    // cheap. Leaves may exceed the limit if too many tris overlap to be divided between leaves.
+    constexpr inline static std::uint32_t MAX_LEAF_TRIS = 32;
+    constexpr inline static std::uint32_t MAX_LEAF_TRI_BLOCKS = (MAX_LEAF_TRIS + 7) / 8;
+
+
+    BoundingBox _box;
+    Node _root;
+    std::vector<Node> _nodeStorage;                         // Empty if viewing external data.
+    std::vector<LeafTriBlock> _triBlockStorage;     // Empty if viewing external data.
+    Span<Node const> _nodes;                        // All nodes except the root.
+    Span<LeafTriBlock const> _triBlocks;            // Tris of all leaves, each leaf's tris contiguous.
+
+    BSPTree(BoundingBox const& box, Node const& root, Span<Node const> nodes, Span<LeafTriBlock const> triBlocks) :
+        _box{box}, _root{root}, _nodeStorage{}, _triBlockStorage{}, _nodes{nodes}, _triBlocks{triBlocks}
+    {}
 
-        return Traverser{line, readOnlySpan(_inodes), readOnlySpan(_leaves), tMin}.visitNode(_root);
+    // Maximum tree depth, which bounds the size of the traversal stack.
+    constexpr inline static unsigned MAX_DEPTH = 64;
+
+    // Node to be traversed, with the range of line parameters within the node.
+    struct TraversalEntry {
+        Node node;
+        float tEntry;
+        float tExit;
+    };
+
+    // Replaces an inode with the child(ren) the line passes through, nearest first. The far child, if any, is pushed
+    // onto the stack.
+    void _traverseInode(Line const& line, PreprocessedLine const& preprocessedLine, TraversalEntry& current,
+            std::array<TraversalEntry, MAX_DEPTH>& stack, std::size_t& stackSize) const {
+        auto const& inode = current.node;
+        auto const axis = inode.divisionAxis();
+        assert(stackSize < stack.size());
+        auto const negativeChild = _nodes[inode.children()];
+        auto const positiveChild = _nodes[inode.children() + 1];
+        auto const planeToLineOrigin = line.origin[axis] - inode.divisionPosition();
+        auto const direction = line.direction[axis];
+        if (planeToLineOrigin == 0.0f && direction == 0.0f) {
+            // Line lies in the division plane, could intersect tris on either side.
+            stack[stackSize++] = {positiveChild, current.tEntry, current.tExit};
+            current.node = negativeChild;
+            return;
+        }
+
+        auto const positiveNear = planeToLineOrigin > 0.0f || (planeToLineOrigin == 0.0f && direction > 0.0f);
+        auto const nearChild = positiveNear ? positiveChild : negativeChild;
+        auto const farChild = !positiveNear ? positiveChild : negativeChild;
+        auto const tDivision = -planeToLineOrigin * preprocessedLine.inverseDirection[axis];
+        if (tDivision <= 0.0f || tDivision > current.tExit) {
+            // Line is heading away from the plane, or leaves the node before reaching it.
+            current.node = nearChild;
+        }
+        else if (tDivision < current.tEntry) {
+            // Line crosses the plane before entering the node.
+            current.node = farChild;
+        }
+        else {
+            stack[stackSize++] = {farChild, tDivision, current.tExit};
+            current = {nearChild, current.tEntry, tDivision};
+        }
     }
 
-private:
-    struct Node {
-        BoundingBox box;
-        std::int32_t index;     // index < 0: leaf at (-index - 1)
-                                // index = 0: empty leaf
-                                // index > 0: inode at (index - 1)
+    // Node to be traversed by a line packet, with the range of line parameters within the node for each line.
+    // Lines which don't pass through the node have empty ranges.
+    struct PacketTraversalEntry {
+        Node node;
+        FVec8 tEntry;
+        FVec8 tExit;
+    };
+
+    // Same as _traverseInode(), for the active lines of a packet.
+    void _traversePacketInode(LinePacket const& lines, PreprocessedLinePacket const& preprocessedLines,
+            unsigned active, PacketTraversalEntry& current, std::array<PacketTraversalEntry, MAX_DEPTH>& stack,
+            std::size_t& stackSize) const {
+        auto const& inode = current.node;
+        auto const axis = inode.divisionAxis();
+        assert(stackSize < stack.size());
+        auto const negativeChild = _nodes[inode.children()];
+        auto const positiveChild = _nodes[inode.children() + 1];
+        auto const planeToLineOrigin = lines.origin[axis] - inode.divisionPosition();
+        auto const& directions = axis == 0 ? lines.directions.x : axis == 1 ? lines.directions.y : lines.directions.z;
+        FVec8 const noLine{INFINITY};
+        if (planeToLineOrigin == 0.0f) {
+            // Lines start in the division plane, so each only enters the child it heads into, or both if it lies in
+            // the plane.
+            stack[stackSize++] = {positiveChild, conditional(directions >= 0.0f, current.tEntry, noLine),
+                current.tExit};
+            current.node = negativeChild;
+            current.tEntry = conditional(directions <= 0.0f, current.tEntry, noLine);
+            return;
+        }
+
+        auto const positiveNear = planeToLineOrigin > 0.0f;
+        auto const nearChild = positiveNear ? positiveChild : negativeChild;
+        auto const farChild = !positiveNear ? positiveChild : negativeChild;
+        auto const& inverseDirections = axis == 0 ? preprocessedLines.inverseDirections.x
+            : axis == 1 ? preprocessedLines.inverseDirections.y : preprocessedLines.inverseDirections.z;
+        auto const tDivision = -planeToLineOrigin * inverseDirections;
+        // Lines heading away from the plane never reach it.
+        auto const tCross = conditional(tDivision > 0.0f, tDivision, noLine);
+        auto const nearExit = min(current.tExit, tCross);
+        auto const farEntry = max(current.tEntry, tCross);
+        auto const nearActive = bitmask(current.tEntry <= nearExit) & active;
+        auto const farActive = bitmask(farEntry <= current.tExit) & active;
+        if (farActive == 0) {
+            current.node = nearChild;
+        }
+        else if (nearActive == 0) {
+            current.node = farChild;
+        }
+        else {
+            stack[stackSize++] = {farChild, farEntry, current.tExit};
+            current = {nearChild, current.tEntry, nearExit};
+        }
+    }
+
+    constexpr inline static float BOX_TOLERANCE = 1e-4f;    // Tolerance for FP error in box containment tests.
+
+    // Surface area heuristic (SAH) cost model, used to choose division planes and when to stop subdividing.
+    // Costs are relative to the cost of visiting an inode.
+    constexpr inline static float TRAVERSAL_COST = 1.0f;
+    constexpr inline static float TRI_BLOCK_INTERSECTION_COST = 1.0f;   // Tris are intersected 8 at a time.
+    constexpr inline static float EMPTY_BONUS = 0.8f;       // Favours divisions which cut off empty space.
+    constexpr inline static unsigned SAH_BIN_COUNT = 32;    // Candidate division planes are at bin boundaries.
+
+    // Maximum number of consecutive subdivisions forced by leaf capacity. Each may duplicate many tris, so this bounds
+    // the growth of tri references where tris overlap too much to be divided well.
+    constexpr inline static unsigned MAX_FORCED_DEPTH = 8;
+
+    // Nodes with at least this many tris are built in parallel.
+    constexpr inline static std::size_t PARALLEL_BUILD_THRESHOLD = 4096;
+
+    // Tri data used during construction, indexed by tri index.
+    struct BuildTris {
+        std::vector<Tri> tris;
+        Span<PreprocessedTri const> preprocessedTris;
     };
 
-    struct INode {
-        Node negativeChild;             // On side of -ve axis direction
-        Node positiveChild;             // On side of +ve axis direction
-        std::uint8_t divisionAxis;      // 0 (X), 1 (Y), 2 (Z)
+    // Reference to a tri in a node, used during construction.
+    struct TriReference {
+        std::uint32_t tri;      // Index into BuildTris (and the mesh's tris).
+        BoundingBox bounds;     // Bounding box of the tri, clipped to the node box.
     };
 
-    struct Leaf {
-        constexpr inline static std::uint8_t MAX_TRIS = 32;
-        constexpr inline static std::uint8_t MAX_TRI_BLOCKS = (MAX_TRIS + 7) / 8;
+    struct BuildTask;
 
-        std::array<PreprocessedTriBlock, MAX_TRI_BLOCKS> tris;
-        std::array<MeshTriIndex, MAX_TRIS> triIndices;
-        std::uint8_t triCount;
+    // Subtree built by a separate task.
+    struct BuildSubtask {
+        std::size_t node;       // Index of the subtree root in the parent task.
+        std::unique_ptr<BuildTask> task;
     };
 
-    Node _root;
-    std::vector<INode> _inodes;
-    std::vector<Leaf> _leaves;
-
-    static Node _createNode(Span<glm::vec3 const> vertexPositions, Span<VertexRange const> vertexRanges,
-            Span<IndexedTri const> tris, PermutedSpan<TriRange const, MaterialIndex> triRanges,
-            Span<PreprocessedTri const> preprocessedTris, Span<TriRange const> preprocessedTriRanges,
-            BoundingBox const& box, std::vector<INode>& inodes, std::vector<Leaf>& leaves,
-            std::uint8_t divisionAxis = 0) {
-        assert(vertexRanges.size() == triRanges.size());
-        assert(divisionAxis < 3);
-
-        {
-            auto const instanceCount = intCast<MeshIndex>(vertexRanges.size());
-            bool subdivide = false;
-            std::array<PreprocessedTri, Leaf::MAX_TRIS> trisInBox{};
-            std::array<MeshTriIndex, Leaf::MAX_TRIS> triIndicesInBox{};
-            std::uint8_t inBoxCount = 0;
-            for (MeshIndex instanceIndex = 0; instanceIndex < instanceCount && !subdivide; ++instanceIndex) {
-                auto const instanceTris = tris[triRanges[instanceIndex]];
-                auto const instanceVertexPositions = vertexPositions[vertexRanges[instanceIndex]];
-                auto const instancePreprocessedTris = preprocessedTris[preprocessedTriRanges[instanceIndex]];
-                auto const triCount = intCast<TriIndex>(instanceTris.size());
-                for (TriIndex triIndex = 0; triIndex < triCount && !subdivide; ++triIndex) {
-                    auto const& meshTri = instanceTris[triIndex];
-                    Tri const tri{
-                        instanceVertexPositions[meshTri.v1],
-                        instanceVertexPositions[meshTri.v2],
-                        instanceVertexPositions[meshTri.v3]
-                    };
-                    if (triIntersectsBox(tri, box)) {
-                        if (inBoxCount < Leaf::MAX_TRIS) {
-                            trisInBox[inBoxCount] = instancePreprocessedTris[triIndex];
-                            triIndicesInBox[inBoxCount] = {instanceIndex, triIndex};
-                            ++inBoxCount;
-                        }
-                        else {
-                            subdivide = true;
-                        }
-                    }
-                }
+    // Output of building a subtree, possibly in parallel with other subtrees.
+    struct BuildTask {
+        Node root;
+        std::vector<Node> nodes;
+        std::vector<LeafTriBlock> triBlocks;
+        std::vector<BuildSubtask> subtasks;     // Subtrees which are yet to be stitched into this subtree.
+    };
+
+    struct Division {
+        std::uint8_t axis;      // 0 (X), 1 (Y), 2 (Z)
+        float position;
+        float cost;
+    };
+
+    // Bounds tree depth, since the SAH may keep cutting off slivers of empty space around tris which aren't
+    // axis-aligned.
+    // Leaves some headroom below MAX_DEPTH for subdivisions forced by leaf capacity.
+    static unsigned _depthLimit(std::size_t triCount) {
+        auto const limit = 8.0f + 1.3f * std::log2(static_cast<float>(std::max<std::size_t>(triCount, 1)));
+        return std::min(static_cast<unsigned>(limit), MAX_DEPTH - 16);
+    }
+
+    static float _leafCost(std::size_t triCount) {
+        return TRI_BLOCK_INTERSECTION_COST * ((triCount + 7) / 8);
+    }
+
+    // Finds the division plane along one axis with the lowest SAH cost.
+    // Candidate planes are the bounds of the tris in the box (to cut off empty space) and binned planes between them.
+    static std::optional<Division> _findAxisDivision(BoundingBox const& box, Span<TriReference const> references,
+            std::uint8_t axis) {
+        auto const boxArea = surfaceArea(box);
+        if (!(boxArea > 0.0f)) {
+            return std::nullopt;
+        }
+        std::optional<Division> best;
+        auto const evaluate = [&box, boxArea, axis, &best](float position, std::size_t negativeCount,
+                std::size_t positiveCount) {
+            auto negativeBox = box;
+            negativeBox.max[axis] = position;
+            auto positiveBox = box;
+            positiveBox.min[axis] = position;
+            auto const bonus = negativeCount == 0 || positiveCount == 0 ? 1.0f - EMPTY_BONUS : 1.0f;
+            auto const cost = TRAVERSAL_COST + bonus * (surfaceArea(negativeBox) * _leafCost(negativeCount)
+                + surfaceArea(positiveBox) * _leafCost(positiveCount)) / boxArea;
+            if (!best || cost < best->cost) {
+                best = {axis, position, cost};
             }
-            if (!subdivide) {
-                if (inBoxCount == 0) {
-                    return {box, 0};
-                }
-                else {
-                    auto const blockCount = (inBoxCount + 7u) / 8u;
-                    std::array<PreprocessedTriBlock, Leaf::MAX_TRI_BLOCKS> triBlocks{};
-                    for (unsigned i = 0; i < blockCount; ++i) {
-                        auto const offset = i * 8;
-                        triBlocks[i] = {
-                            {
-                                trisInBox[offset].normal, trisInBox[offset + 1].normal,
-                                trisInBox[offset + 2].normal, trisInBox[offset + 3].normal,
-                                trisInBox[offset + 4].normal, trisInBox[offset + 5].normal,
-                                trisInBox[offset + 6].normal, trisInBox[offset + 7].normal
-                            },
-                            {
-                                trisInBox[offset].v1, trisInBox[offset + 1].v1,
-                                trisInBox[offset + 2].v1, trisInBox[offset + 3].v1,
-                                trisInBox[offset + 4].v1, trisInBox[offset + 5].v1,
-                                trisInBox[offset + 6].v1, trisInBox[offset + 7].v1
-                            },
-                            {
-                                trisInBox[offset].v1ToV2, trisInBox[offset + 1].v1ToV2,
-                                trisInBox[offset + 2].v1ToV2, trisInBox[offset + 3].v1ToV2,
-                                trisInBox[offset + 4].v1ToV2, trisInBox[offset + 5].v1ToV2,
-                                trisInBox[offset + 6].v1ToV2, trisInBox[offset + 7].v1ToV2
-                            },
-                            {
-                                trisInBox[offset].v1ToV3, trisInBox[offset + 1].v1ToV3,
-                                trisInBox[offset + 2].v1ToV3, trisInBox[offset + 3].v1ToV3,
-                                trisInBox[offset + 4].v1ToV3, trisInBox[offset + 5].v1ToV3,
-                                trisInBox[offset + 6].v1ToV3, trisInBox[offset + 7].v1ToV3
-                            }
-                        };
-                    }
-                    leaves.push_back({triBlocks, triIndicesInBox, inBoxCount});
-                    return {box, -intCast<std::int32_t>(leaves.size())};
-                }
+        };
+
+        auto trisMin = box.max[axis];
+        auto trisMax = box.min[axis];
+        for (auto const& tri : references) {
+            trisMin = std::min(trisMin, tri.bounds.min[axis]);
+            trisMax = std::max(trisMax, tri.bounds.max[axis]);
+        }
+        // Planes must be strictly inside the box so the children are smaller, otherwise we may never terminate.
+        if (trisMin > box.min[axis] && trisMin < box.max[axis]) {
+            evaluate(trisMin, 0, references.size());
+        }
+        if (trisMax > box.min[axis] && trisMax < box.max[axis]) {
+            // Tris lying in the plane go to the positive side, so that side may not be empty.
+            auto const inPlaneCount = std::count_if(references.begin(), references.end(),
+                [axis, trisMax](TriReference const& tri) { return tri.bounds.min[axis] == trisMax; });
+            evaluate(trisMax, references.size() - inPlaneCount, inPlaneCount);
+        }
+
+        auto const extent = trisMax - trisMin;
+        if (!(extent > 0.0f)) {
+            return best;
+        }
+        auto const binIndex = [trisMin, extent](float position) {
+            auto const bin = static_cast<int>((position - trisMin) / extent * SAH_BIN_COUNT);
+            return static_cast<unsigned>(std::clamp(bin, 0, static_cast<int>(SAH_BIN_COUNT) - 1));
+        };
+        // Number of tris whose bounds start/end in each bin.
+        std::array<std::size_t, SAH_BIN_COUNT> startCounts{};
+        std::array<std::size_t, SAH_BIN_COUNT> endCounts{};
+        for (auto const& tri : references) {
+            ++startCounts[binIndex(tri.bounds.min[axis])];
+            ++endCounts[binIndex(tri.bounds.max[axis])];
+        }
+        std::size_t negativeCount = 0;
+        std::size_t positiveCount = references.size();
+        for (unsigned plane = 1; plane < SAH_BIN_COUNT; ++plane) {
+            negativeCount += startCounts[plane - 1];
+            positiveCount -= endCounts[plane - 1];
+            evaluate(trisMin + extent * plane / SAH_BIN_COUNT, negativeCount, positiveCount);
+        }
+        return best;
+    }
+
+    // Finds the division plane with the lowest SAH cost.
+    static std::optional<Division> _findDivision(BoundingBox const& box, Span<TriReference const> references) {
+        std::array<std::optional<Division>, 3> axisDivisions;
+        auto const findAxisDivision = [&box, references, &axisDivisions](std::uint8_t const& axis) {
+            axisDivisions[axis] = _findAxisDivision(box, references, axis);
+        };
+        constexpr std::array<std::uint8_t, 3> AXES{0, 1, 2};
+        if (references.size() >= PARALLEL_BUILD_THRESHOLD) {
+            std::for_each(std::execution::par, AXES.cbegin(), AXES.cend(), findAxisDivision);
+        }
+        else {
+            std::for_each(AXES.cbegin(), AXES.cend(), findAxisDivision);
+        }
+
+        std::optional<Division> best;
+        for (auto const& division : axisDivisions) {
+            if (division && (!best || division->cost < best->cost)) {
+                best = division;
             }
         }
+        return best;
+    }
+
+    static Node _createLeaf(BuildTris const& buildTris, Span<TriReference const> references, BuildTask& task) {
+        auto const triCount = intCast<std::uint32_t>(references.size());
+        if (triCount == 0) {
+            return Node::emptyLeaf();
+        }
+
+        std::vector<std::uint32_t> tris(triCount);
+        for (unsigned i = 0; i < triCount; ++i) {
+            tris[i] = references[i].tri;
+        }
+        auto const firstTriBlock = task.triBlocks.size();
+        appendLeafTriBlocks(buildTris.preprocessedTris, tris, task.triBlocks);
+        return Node::leaf(firstTriBlock, triCount);
+    }
+
+    // Creates the node for a box, given the tris in the box.
+    // The references are reused (and overwritten) for the negative child, so each node only processes its own tris.
+    // forcedDepth is the number of consecutive ancestors whose division was forced by leaf capacity.
+    static Node _createNode(BuildTris const& buildTris, Span<TriReference> references, BoundingBox const& box,
+            BuildTask& task, unsigned depth, unsigned depthLimit, unsigned forcedDepth) {
+        if (references.size() == 0) {
+            return Node::emptyLeaf();
+        }
+
+        auto const division = _findDivision(box, readOnlySpan(references));
+        auto const leaf = depthLimit == 0 || !division || division->cost >= _leafCost(references.size());
+        auto const forced = leaf && references.size() > MAX_LEAF_TRIS;
+        if ((leaf && !forced) || !division || depth + 1 >= MAX_DEPTH
+                || (forced && forcedDepth >= MAX_FORCED_DEPTH)) {
+            return _createLeaf(buildTris, readOnlySpan(references), task);
+        }
+        // Leaves have limited capacity, so must subdivide even if the SAH says it's not worthwhile.
 
+        auto const axis = division->axis;
+        auto const position = division->position;
         auto negativeSubbox = box;
+        negativeSubbox.max[axis] = position;
         auto positiveSubbox = box;
-        switch (divisionAxis) {
-        case 0: {
-                auto const centre = (box.min.x + box.max.x) / 2.0f;
-                negativeSubbox.max.x = centre;
-                positiveSubbox.min.x = centre;
-                break;
+        positiveSubbox.min[axis] = position;
+
+        // Partition the tris between the children.
+        // Tris which only touch the division plane belong on the side they are on, and tris lying in the plane belong
+        // on the positive side. This allows empty space to be cut off right up to the bounds of tris.
+        // Only tris straddling the plane need to be tested against the child boxes. The boxes are expanded to account
+        // for FP error with tris right on the box faces.
+        BoundingBox const negativeToleranceBox{negativeSubbox.min - BOX_TOLERANCE, negativeSubbox.max + BOX_TOLERANCE};
+        BoundingBox const positiveToleranceBox{positiveSubbox.min - BOX_TOLERANCE, positiveSubbox.max + BOX_TOLERANCE};
+        std::vector<TriReference> positiveReferences;
+        std::size_t negativeCount = 0;
+        for (auto const& reference : references) {
+            auto const& bounds = reference.bounds;
+            auto inNegative = bounds.min[axis] < position;
+            auto inPositive = bounds.max[axis] > position || bounds.min[axis] == position;
+            if (inNegative && inPositive) {
+                auto const& tri = buildTris.tris[reference.tri];
+                inNegative = triIntersectsBox(tri, negativeToleranceBox);
+                inPositive = triIntersectsBox(tri, positiveToleranceBox);
             }
-        case 1: {
-                auto const centre = (box.min.y + box.max.y) / 2.0f;
-                negativeSubbox.max.y = centre;
-                positiveSubbox.min.y = centre;
-                break;
+            if (inPositive) {
+                positiveReferences.push_back({reference.tri, boxIntersection(bounds, positiveSubbox)});
             }
-        case 2: {
-                auto const centre = (box.min.z + box.max.z) / 2.0f;
-                negativeSubbox.max.z = centre;
-                positiveSubbox.min.z = centre;
-                break;
+            if (inNegative) {
+                references[negativeCount] = {reference.tri, boxIntersection(bounds, negativeSubbox)};
+                ++negativeCount;
             }
         }
-        std::uint8_t const nextDivisionAxis = (divisionAxis + 1) % 3;
-        auto const index = inodes.size();
-        // Insert inode before recursing so they're in traversal order (hopefully better for cache).
-        inodes.push_back({{}, {}, divisionAxis});
-        inodes[index].negativeChild = _createNode(vertexPositions, vertexRanges, tris, triRanges, preprocessedTris,
-            preprocessedTriRanges, negativeSubbox, inodes, leaves, nextDivisionAxis);
-        inodes[index].positiveChild = _createNode(vertexPositions, vertexRanges, tris, triRanges, preprocessedTris,
-            preprocessedTriRanges, positiveSubbox, inodes, leaves, nextDivisionAxis);
-        return {box, intCast<std::int32_t>(index + 1)};
+
+        // If a forced division puts all the tris in one child (e.g. when they all overlap), that child is no smaller, so
+        // subdividing would only duplicate tris.
+        if (forced && positiveReferences.size() == references.size()) {
+            return _createLeaf(buildTris, readOnlySpan(positiveReferences), task);
+        }
+        if (forced && negativeCount == references.size()) {
+            return _createLeaf(buildTris, readOnlySpan(references), task);
+        }
+
+        auto const childDepthLimit = depthLimit > 0 ? depthLimit - 1 : 0;
+        auto const childForcedDepth = forced ? forcedDepth + 1 : 0;
+        // Reserve the children's slots before recursing, so they're adjacent and the subtrees follow them.
+        auto const children = task.nodes.size();
+        task.nodes.resize(children + 2);
+        if (references.size() >= PARALLEL_BUILD_THRESHOLD) {
+            // Build the children in parallel with separate output, to be stitched together afterwards.
+            std::array<BuildSubtask, 2> subtasks{{
+                {children, std::make_unique<BuildTask>()},
+                {children + 1, std::make_unique<BuildTask>()}
+            }};
+            std::for_each(std::execution::par, subtasks.begin(), subtasks.end(),
+                    [&, negativeCount, children](BuildSubtask const& subtask) {
+                if (subtask.node == children + 1) {
+                    subtask.task->root = _createNode(buildTris, Span{positiveReferences}, positiveSubbox,
+                        *subtask.task, depth + 1, childDepthLimit, childForcedDepth);
+                }
+                else {
+                    subtask.task->root = _createNode(buildTris, Span{references.data(), negativeCount}, negativeSubbox,
+                        *subtask.task, depth + 1, childDepthLimit, childForcedDepth);
+                }
+            });
+            task.subtasks.push_back(std::move(subtasks[0]));
+            task.subtasks.push_back(std::move(subtasks[1]));
+        }
+        else {
+            // Vector may be reallocated by the recursion, so don't hold references into it.
+            auto const negativeChild = _createNode(buildTris, Span{references.data(), negativeCount},
+                negativeSubbox, task, depth + 1, childDepthLimit, childForcedDepth);
+            task.nodes[children] = negativeChild;
+            auto const positiveChild = _createNode(buildTris, Span{positiveReferences}, positiveSubbox,
+                task, depth + 1, childDepthLimit, childForcedDepth);
+            task.nodes[children + 1] = positiveChild;
+        }
+        return Node::inode(axis, position, children);
+    }
+
+    // Appends the nodes from a build task and its subtasks to the tree. Each task's subtree is stored contiguously.
+    // Returns the task's root node.
+    Node _stitchBuildTask(BuildTask& task) {
+        auto const nodeOffset = _nodeStorage.size();
+        auto const triBlockOffset = _triBlockStorage.size();
+        for (auto const& node : task.nodes) {
+            _nodeStorage.push_back(node.offset(nodeOffset, triBlockOffset));
+        }
+        _triBlockStorage.insert(_triBlockStorage.end(), task.triBlocks.cbegin(), task.triBlocks.cend());
+        task.nodes = {};
+        task.triBlocks = {};
+
+        for (auto const& subtask : task.subtasks) {
+            auto const subtaskRoot = _stitchBuildTask(*subtask.task);
+            _nodeStorage[nodeOffset + subtask.node] = subtaskRoot;
+        }
+        return task.root.offset(nodeOffset, triBlockOffset);
     }
 };
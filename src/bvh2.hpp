@@ -0,0 +1,464 @@
+#pragma once
+
+#include "bvh_build.hpp"
+#include "geometry.hpp"
+#include "index_types.hpp"
+#include "leaf_tris.hpp"
+#include "mesh.hpp"
+#include "utility/binary_cache.hpp"
+#include "utility/index_iterator.hpp"
+#include "utility/numeric.hpp"
+#include "utility/radix_sort.hpp"
+#include "utility/span.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <execution>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+
+// Binary bounding volume hierarchy for line-mesh intersections, for a single mesh.
+// By default each tri is in exactly one leaf, unlike the BSP tree. Optionally, spatial splits (see bvh_build.hpp) may
+// put a tri in multiple leaves, up to a budget of extra references as a fraction of the tri count.
+class BVH2 {
+public:
+    BVH2(Span<glm::vec3 const> vertexPositions, Span<IndexedTri const> tris,
+            Span<PreprocessedTri const> preprocessedTris, float duplicationBudget = 0.0f) :
+        _box{computeBoundingBox(vertexPositions)}, _nodeStorage{}, _triBlockStorage{}, _nodes{}, _triBlocks{}
+    {
+        assert(tris.size() == preprocessedTris.size());
+
+        std::vector<BVHBuildReference> references;
+        references.reserve(tris.size());
+        auto const triCount = intCast<std::uint32_t>(tris.size());
+        for (std::uint32_t triIndex = 0; triIndex < triCount; ++triIndex) {
+            auto const& meshTri = tris[triIndex];
+            Tri const tri{vertexPositions[meshTri.v1], vertexPositions[meshTri.v2], vertexPositions[meshTri.v3]};
+            auto const bounds = computeBoundingBox(tri);
+            references.push_back({triIndex, bounds, (bounds.min + bounds.max) * 0.5f});
+        }
+
+        if (references.size() > 0) {
+            BuildState state{
+                vertexPositions, tris, preprocessedTris, surfaceArea(referencesBounds(readOnlySpan(references)))
+            };
+            auto const maxDuplicates = static_cast<std::size_t>(duplicationBudget * references.size());
+            _triBlockStorage.reserve((references.size() + 7) / 8);
+            _nodeStorage.emplace_back();
+            _createNode(state, std::move(references), maxDuplicates, 0, 0);
+        }
+        _nodes = readOnlySpan(_nodeStorage);
+        _triBlocks = readOnlySpan(_triBlockStorage);
+    }
+
+    // Builds a linear BVH (LBVH), which is much faster to build than with the SAH, but traversal is slower.
+    // Tris are sorted by the Morton codes of their centres, and each node divides its tris where the highest bit
+    // which differs between their codes changes, i.e. at the middle of the smallest Morton cell containing them.
+    static BVH2 linear(Span<glm::vec3 const> vertexPositions, Span<IndexedTri const> tris,
+            Span<PreprocessedTri const> preprocessedTris) {
+        assert(tris.size() == preprocessedTris.size());
+
+        BVH2 tree{computeBoundingBox(vertexPositions), {}, {}};
+        if (tris.size() > 0) {
+            LinearBuild build{std::vector<BoundingBox>(tris.size()), std::vector<MortonReference>(tris.size()),
+                preprocessedTris};
+            std::for_each(std::execution::par, IndexIterator{std::size_t{0}}, IndexIterator{tris.size()},
+                    [&](std::size_t triIndex) {
+                auto const& meshTri = tris[triIndex];
+                build.triBounds[triIndex] = computeBoundingBox(
+                    Tri{vertexPositions[meshTri.v1], vertexPositions[meshTri.v2], vertexPositions[meshTri.v3]});
+            });
+
+            BoundingBox centreBounds{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+            for (auto const& bounds : build.triBounds) {
+                auto const centre = (bounds.min + bounds.max) * 0.5f;
+                centreBounds.min = glm::min(centreBounds.min, centre);
+                centreBounds.max = glm::max(centreBounds.max, centre);
+            }
+            std::for_each(std::execution::par, IndexIterator{std::size_t{0}}, IndexIterator{tris.size()},
+                    [&](std::size_t triIndex) {
+                auto const& bounds = build.triBounds[triIndex];
+                build.references[triIndex] = {
+                    mortonCode((bounds.min + bounds.max) * 0.5f, centreBounds), intCast<std::uint32_t>(triIndex)};
+            });
+            parallelRadixSort(build.references, [](MortonReference const& reference) { return reference.code; });
+
+            tree._triBlockStorage.reserve((tris.size() + LINEAR_LEAF_TRIS - 1) / LINEAR_LEAF_TRIS);
+            tree._nodeStorage.reserve(2 * ((tris.size() + LINEAR_LEAF_TRIS - 1) / LINEAR_LEAF_TRIS));
+            tree._nodeStorage.emplace_back();
+            BuildTask rootTask;
+            rootTask.root = _createLinearNode(build, 0, tris.size(), rootTask, 0);
+            tree._nodeStorage[0] = tree._stitchBuildTask(rootTask);
+        }
+        tree._nodes = readOnlySpan(tree._nodeStorage);
+        tree._triBlocks = readOnlySpan(tree._triBlockStorage);
+        return tree;
+    }
+
+    // Creates a tree viewing data written by write(), which must outlive the tree.
+    static BVH2 read(CacheReader& reader) {
+        auto const box = reader.read<BoundingBox>();
+        auto const nodes = reader.readArray<Node>();
+        auto const triBlocks = reader.readArray<LeafTriBlock>();
+        return BVH2{box, nodes, triBlocks};
+    }
+
+    // The tree may view its own storage, so copies would be invalid.
+    BVH2(BVH2 const&) = delete;
+    BVH2(BVH2&&) = default;
+    BVH2& operator=(BVH2 const&) = delete;
+    BVH2& operator=(BVH2&&) = default;
+
+    BoundingBox const& box() const {
+        return _box;
+    }
+
+    void write(CacheWriter& writer) const {
+        writer.write(_box);
+        writer.writeArray(_nodes);
+        writer.writeArray(_triBlocks);
+    }
+
+    // Finds the nearest intersection with line parameter in [tMin, tMax].
+    template<SurfaceConsideration Surfaces>
+    std::optional<LineTriIntersection> lineTriNearestIntersection(Line const& line, float tMin, float tMax) const {
+        if (_nodes.size() == 0) {
+            return std::nullopt;
+        }
+        auto const preprocessedLine = preprocessLine(line);
+        auto const rootInterval = lineBoxIntersection(preprocessedLine, _nodes[0].box, tMin, tMax);
+        if (rootInterval.empty()) {
+            return std::nullopt;
+        }
+
+        std::optional<LineTriIntersection> nearestIntersection;
+        std::array<StackEntry, STACK_SIZE> stack;
+        std::size_t stackSize = 0;
+        stack[stackSize++] = {0, rootInterval.entry};
+        while (stackSize > 0) {
+            auto const entry = stack[--stackSize];
+            if (nearestIntersection && entry.tEntry > nearestIntersection->t) {
+                continue;
+            }
+            auto const& node = _nodes[entry.index];
+            if (node.triCount > 0) {
+                leafNearestIntersection<Surfaces>(line, _triBlocks.data() + node.index, node.triCount, tMin, tMax,
+                    nearestIntersection);
+                continue;
+            }
+
+            auto const tNearest = nearestIntersection ? nearestIntersection->t : tMax;
+            auto const negative = lineBoxIntersection(preprocessedLine, _nodes[node.index].box, tMin, tNearest);
+            auto const positive = lineBoxIntersection(preprocessedLine, _nodes[node.index + 1].box, tMin, tNearest);
+            // Push the far child first, so the near child is visited first.
+            StackEntry const negativeEntry{node.index, negative.entry};
+            StackEntry const positiveEntry{node.index + 1, positive.entry};
+            auto const negativeNearer = negative.entry <= positive.entry;
+            if (!positive.empty() && negativeNearer) {
+                stack[stackSize++] = positiveEntry;
+            }
+            if (!negative.empty()) {
+                stack[stackSize++] = negativeEntry;
+            }
+            if (!positive.empty() && !negativeNearer) {
+                stack[stackSize++] = positiveEntry;
+            }
+            assert(stackSize <= stack.size());
+        }
+        return nearestIntersection;
+    }
+
+    // Checks if a line intersects any tri with line parameter in [tMin, tMax].
+    // Faster than finding the nearest intersection, as traversal stops at the first intersection found.
+    template<SurfaceConsideration Surfaces>
+    bool occluded(Line const& line, float tMin, float tMax) const {
+        if (_nodes.size() == 0) {
+            return false;
+        }
+        auto const preprocessedLine = preprocessLine(line);
+        if (lineBoxIntersection(preprocessedLine, _nodes[0].box, tMin, tMax).empty()) {
+            return false;
+        }
+
+        std::array<std::uint32_t, STACK_SIZE> stack;
+        std::size_t stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0) {
+            auto const& node = _nodes[stack[--stackSize]];
+            if (node.triCount > 0) {
+                if (leafOccluded<Surfaces>(line, _triBlocks.data() + node.index, node.triCount, tMin, tMax)) {
+                    return true;
+                }
+                continue;
+            }
+
+            // Any intersection will do, so the order of the children doesn't matter.
+            for (std::uint32_t child = node.index; child < node.index + 2; ++child) {
+                if (!lineBoxIntersection(preprocessedLine, _nodes[child].box, tMin, tMax).empty()) {
+                    stack[stackSize++] = child;
+                }
+            }
+            assert(stackSize <= stack.size());
+        }
+        return false;
+    }
+
+private:
+    struct Node {
+        BoundingBox box;
+        std::uint32_t index;        // For an inode, index of the first of its 2 adjacent children. For a leaf, index of
+                                    // its first tri block.
+        std::uint32_t triCount;     // Number of tris in the leaf, or 0 for an inode.
+
+        // Offsets the node's index, for when the nodes and tri blocks it refers to are moved.
+        Node offset(std::size_t nodeOffset, std::size_t triBlockOffset) const {
+            auto const indexOffset = triCount > 0 ? triBlockOffset : nodeOffset;
+            return {box, intCast<std::uint32_t>(index + indexOffset), triCount};
+        }
+    };
+
+    struct BuildState {
+        Span<glm::vec3 const> vertexPositions;
+        Span<IndexedTri const> tris;
+        Span<PreprocessedTri const> preprocessedTris;
+        float rootArea;
+    };
+
+    // Tri reference in linear construction.
+    struct MortonReference {
+        std::uint64_t code;         // Morton code of the tri centre.
+        std::uint32_t tri;          // Index into the mesh's tris.
+    };
+
+    // Tri data used during linear construction.
+    struct LinearBuild {
+        std::vector<BoundingBox> triBounds;         // Indexed by tri index.
+        std::vector<MortonReference> references;    // Sorted by Morton code.
+        Span<PreprocessedTri const> preprocessedTris;
+    };
+
+    struct BuildTask;
+
+    // Subtree built by a separate task.
+    struct BuildSubtask {
+        std::size_t node;       // Index of the subtree root in the parent task.
+        std::unique_ptr<BuildTask> task;
+    };
+
+    // Output of building a subtree, possibly in parallel with other subtrees.
+    struct BuildTask {
+        Node root;
+        std::vector<Node> nodes;
+        std::vector<LeafTriBlock> triBlocks;
+        std::vector<BuildSubtask> subtasks;     // Subtrees which are yet to be stitched into this subtree.
+    };
+
+    struct StackEntry {
+        std::uint32_t index;        // Node index.
+        float tEntry;               // Line parameter at which the line enters the node box.
+    };
+
+    // Leaves with more tris than this are split even if the SAH says it's not worthwhile.
+    constexpr inline static std::size_t MAX_LEAF_TRIS = 32;
+    // Maximum number of tris in a leaf of a linear BVH. Leaves are not sized by the SAH.
+    constexpr inline static std::size_t LINEAR_LEAF_TRIS = 8;
+    // Below this depth, nodes are split at the median rather than with the SAH, which bounds the tree depth.
+    constexpr inline static unsigned SAH_DEPTH_LIMIT = 48;
+    // Median splits halve the tris, so there are at most 32 levels of them after SAH_DEPTH_LIMIT. Linear BVH splits
+    // use up at least 1 of the 63 Morton code bits each, after which there are at most 32 levels of median splits.
+    constexpr inline static unsigned MAX_DEPTH = 96;
+    static_assert(ceilLog2(std::uint64_t{std::numeric_limits<TriIndex>::max()} + 1) <= 32);    // For MAX_DEPTH.
+    // Each inode visited pushes at most 2 entries and pops 1.
+    constexpr inline static std::size_t STACK_SIZE = MAX_DEPTH + 1;
+    // Subtrees with at least this many tris are built in parallel in linear construction.
+    constexpr inline static std::size_t PARALLEL_BUILD_THRESHOLD = 16384;
+
+    BoundingBox _box;
+    std::vector<Node> _nodeStorage;                 // Empty if viewing external data.
+    std::vector<LeafTriBlock> _triBlockStorage;     // Empty if viewing external data.
+    Span<Node const> _nodes;                        // Root is the first node.
+    Span<LeafTriBlock const> _triBlocks;            // Tris of all leaves, each leaf's tris contiguous.
+
+    BVH2(BoundingBox const& box, Span<Node const> nodes, Span<LeafTriBlock const> triBlocks) :
+        _box{box}, _nodeStorage{}, _triBlockStorage{}, _nodes{nodes}, _triBlocks{triBlocks}
+    {}
+
+    // Fills in the already allocated node for a set of tris, appending its descendants to the tree.
+    // maxDuplicates is the number of references which spatial splits may add within the subtree. What a node's split
+    // doesn't use is divided between its children in proportion to their reference counts, so subtrees built first
+    // can't use up the budget of the rest of the tree.
+    void _createNode(BuildState const& state, std::vector<BVHBuildReference> references, std::size_t maxDuplicates,
+            std::size_t nodeIndex, unsigned depth) {
+        assert(references.size() > 0);
+        assert(depth < MAX_DEPTH);
+
+        auto const bounds = referencesBounds(readOnlySpan(references));
+        std::optional<BVHObjectSplit> objectSplit;
+        std::optional<BVHSpatialSplit> spatialSplit;
+        if (depth < SAH_DEPTH_LIMIT) {
+            objectSplit = findObjectSplit(readOnlySpan(references), bounds);
+            // Spatial splits only help if the object split children overlap significantly.
+            auto trySpatialSplit = maxDuplicates > 0;
+            if (trySpatialSplit && objectSplit) {
+                auto const overlap = boxIntersection(objectSplit->negativeBounds, objectSplit->positiveBounds);
+                trySpatialSplit = !boxEmpty(overlap) && surfaceArea(overlap) > SBVH_OVERLAP_THRESHOLD * state.rootArea;
+            }
+            if (trySpatialSplit) {
+                spatialSplit = findSpatialSplit(state.vertexPositions, state.tris, readOnlySpan(references), bounds,
+                    maxDuplicates);
+                if (spatialSplit && objectSplit && spatialSplit->cost >= objectSplit->cost) {
+                    spatialSplit = std::nullopt;
+                }
+            }
+        }
+        auto const splitCost = spatialSplit ? spatialSplit->cost : (objectSplit ? objectSplit->cost : INFINITY);
+
+        if (splitCost >= bvhLeafCost(references.size()) && references.size() <= MAX_LEAF_TRIS) {
+            std::array<std::uint32_t, MAX_LEAF_TRIS> tris{};
+            for (std::size_t i = 0; i < references.size(); ++i) {
+                tris[i] = references[i].tri;
+            }
+            _nodeStorage[nodeIndex] = {bounds, intCast<std::uint32_t>(_triBlockStorage.size()),
+                intCast<std::uint32_t>(references.size())};
+            appendLeafTriBlocks(state.preprocessedTris, Span{tris.data(), references.size()}, _triBlockStorage);
+            return;
+        }
+
+        std::vector<BVHBuildReference> negativeReferences;
+        std::vector<BVHBuildReference> positiveReferences;
+        if (spatialSplit) {
+            std::tie(negativeReferences, positiveReferences) = spatialPartitionReferences(state.vertexPositions,
+                state.tris, readOnlySpan(references), *spatialSplit);
+        }
+        // Reference unsplitting may leave a side empty, in which case an object split is used instead.
+        if (negativeReferences.empty() || positiveReferences.empty()) {
+            auto const negativeCount = objectSplit
+                ? partitionReferences(Span{references}, *objectSplit)
+                : medianPartitionReferences(Span{references});
+            negativeReferences.assign(references.cbegin(), references.cbegin() + negativeCount);
+            positiveReferences.assign(references.cbegin() + negativeCount, references.cend());
+        }
+        auto const childReferenceCount = negativeReferences.size() + positiveReferences.size();
+        auto const duplicates = childReferenceCount - references.size();
+        auto const childMaxDuplicates = maxDuplicates - std::min(duplicates, maxDuplicates);
+        auto const negativeMaxDuplicates = static_cast<std::size_t>(
+            static_cast<double>(childMaxDuplicates) * negativeReferences.size() / childReferenceCount);
+        references = {};
+
+        // Children are allocated together so they are adjacent.
+        auto const childIndex = _nodeStorage.size();
+        _nodeStorage.emplace_back();
+        _nodeStorage.emplace_back();
+        _nodeStorage[nodeIndex] = {bounds, intCast<std::uint32_t>(childIndex), 0};
+        _createNode(state, std::move(negativeReferences), negativeMaxDuplicates, childIndex, depth + 1);
+        _createNode(state, std::move(positiveReferences), childMaxDuplicates - negativeMaxDuplicates, childIndex + 1,
+            depth + 1);
+    }
+
+    // Finds where to divide a range of the Morton-sorted tris: the first tri with the highest bit which differs
+    // within the range set, or the middle if the codes are all the same.
+    static std::size_t _linearSplit(Span<MortonReference const> references, std::size_t first, std::size_t last) {
+        auto const differentBits = references[first].code ^ references[last - 1].code;
+        if (differentBits == 0) {
+            return (first + last) / 2;
+        }
+        auto bit = std::uint64_t{1} << 63;
+        while (!(differentBits & bit)) {
+            bit >>= 1;
+        }
+        // Codes are sorted and share all higher bits, so those without the bit set come first.
+        auto const split = std::partition_point(references.begin() + first, references.begin() + last,
+            [bit](MortonReference const& reference) { return !(reference.code & bit); });
+        return static_cast<std::size_t>(split - references.begin());
+    }
+
+    // Creates the node for a range of the Morton-sorted tris, appending its descendants to the task.
+    static Node _createLinearNode(LinearBuild const& build, std::size_t first, std::size_t last, BuildTask& task,
+            unsigned depth) {
+        assert(last > first);
+        assert(depth < MAX_DEPTH);
+
+        auto const triCount = last - first;
+        if (triCount <= LINEAR_LEAF_TRIS) {
+            BoundingBox box{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+            std::array<std::uint32_t, LINEAR_LEAF_TRIS> tris{};
+            for (std::size_t i = 0; i < triCount; ++i) {
+                tris[i] = build.references[first + i].tri;
+                box.min = glm::min(box.min, build.triBounds[tris[i]].min);
+                box.max = glm::max(box.max, build.triBounds[tris[i]].max);
+            }
+            auto const firstTriBlock = intCast<std::uint32_t>(task.triBlocks.size());
+            appendLeafTriBlocks(build.preprocessedTris, Span{tris.data(), triCount}, task.triBlocks);
+            return {box, firstTriBlock, intCast<std::uint32_t>(triCount)};
+        }
+
+        auto const split = _linearSplit(readOnlySpan(build.references), first, last);
+        // Reserve the children's slots before recursing, so they're adjacent and the subtrees follow them.
+        auto const children = task.nodes.size();
+        task.nodes.resize(children + 2);
+        Node negativeChild;
+        Node positiveChild;
+        if (triCount >= PARALLEL_BUILD_THRESHOLD) {
+            // Build the children in parallel with separate output, to be stitched together afterwards.
+            std::array<BuildSubtask, 2> subtasks{{
+                {children, std::make_unique<BuildTask>()},
+                {children + 1, std::make_unique<BuildTask>()}
+            }};
+            std::for_each(std::execution::par, subtasks.begin(), subtasks.end(),
+                    [&, children](BuildSubtask const& subtask) {
+                if (subtask.node == children + 1) {
+                    subtask.task->root = _createLinearNode(build, split, last, *subtask.task, depth + 1);
+                }
+                else {
+                    subtask.task->root = _createLinearNode(build, first, split, *subtask.task, depth + 1);
+                }
+            });
+            negativeChild = subtasks[0].task->root;
+            positiveChild = subtasks[1].task->root;
+            task.subtasks.push_back(std::move(subtasks[0]));
+            task.subtasks.push_back(std::move(subtasks[1]));
+        }
+        else {
+            // Vector may be reallocated by the recursion, so don't hold references into it.
+            negativeChild = _createLinearNode(build, first, split, task, depth + 1);
+            task.nodes[children] = negativeChild;
+            positiveChild = _createLinearNode(build, split, last, task, depth + 1);
+            task.nodes[children + 1] = positiveChild;
+        }
+        BoundingBox const box{
+            glm::min(negativeChild.box.min, positiveChild.box.min),
+            glm::max(negativeChild.box.max, positiveChild.box.max)
+        };
+        return {box, intCast<std::uint32_t>(children), 0};
+    }
+
+    // Appends the nodes from a build task and its subtasks to the tree. Each task's subtree is stored contiguously.
+    // Returns the task's root node.
+    Node _stitchBuildTask(BuildTask& task) {
+        auto const nodeOffset = _nodeStorage.size();
+        auto const triBlockOffset = _triBlockStorage.size();
+        for (auto const& node : task.nodes) {
+            _nodeStorage.push_back(node.offset(nodeOffset, triBlockOffset));
+        }
+        _triBlockStorage.insert(_triBlockStorage.end(), task.triBlocks.cbegin(), task.triBlocks.cend());
+        task.nodes = {};
+        task.triBlocks = {};
+
+        for (auto const& subtask : task.subtasks) {
+            auto const subtaskRoot = _stitchBuildTask(*subtask.task);
+            _nodeStorage[nodeOffset + subtask.node] = subtaskRoot;
+        }
+        return task.root.offset(nodeOffset, triBlockOffset);
+    }
+};
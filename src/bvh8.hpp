@@ -0,0 +1,345 @@
+#pragma once
+
+#include "bvh_build.hpp"
+#include "geometry.hpp"
+#include "index_types.hpp"
+#include "leaf_tris.hpp"
+#include "mesh.hpp"
+#include "utility/binary_cache.hpp"
+#include "utility/numeric.hpp"
+#include "utility/span.hpp"
+#include "utility/vectorised.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+
+// 8-wide bounding volume hierarchy for line-mesh intersections, for a single mesh.
+// Each node stores the boxes of up to 8 children as vectors, so a line is tested against all of them at once, matching
+// the 8-wide leaf tri intersection.
+class BVH8 {
+public:
+    BVH8(Span<glm::vec3 const> vertexPositions, Span<IndexedTri const> tris,
+            Span<PreprocessedTri const> preprocessedTris) :
+        _box{computeBoundingBox(vertexPositions)}, _nodeStorage{}, _triBlockStorage{}, _nodes{}, _triBlocks{}
+    {
+        assert(tris.size() == preprocessedTris.size());
+
+        std::vector<BVHBuildReference> references;
+        references.reserve(tris.size());
+        // The tri count bounds the tree depth (see MEDIAN_DEPTH_LIMIT).
+        auto const triCount = intCast<TriIndex>(tris.size());
+        for (std::uint32_t triIndex = 0; triIndex < triCount; ++triIndex) {
+            auto const& meshTri = tris[triIndex];
+            Tri const tri{vertexPositions[meshTri.v1], vertexPositions[meshTri.v2], vertexPositions[meshTri.v3]};
+            auto const bounds = computeBoundingBox(tri);
+            references.push_back({triIndex, bounds, (bounds.min + bounds.max) * 0.5f});
+        }
+
+        if (references.size() > 0) {
+            _triBlockStorage.reserve((references.size() + 7) / 8);
+            _createNode(preprocessedTris, Span{references}, 0);
+        }
+        _nodes = readOnlySpan(_nodeStorage);
+        _triBlocks = readOnlySpan(_triBlockStorage);
+    }
+
+    // Creates a tree viewing data written by write(), which must outlive the tree.
+    static BVH8 read(CacheReader& reader) {
+        auto const box = reader.read<BoundingBox>();
+        auto const nodes = reader.readArray<Node>();
+        auto const triBlocks = reader.readArray<LeafTriBlock>();
+        return BVH8{box, nodes, triBlocks};
+    }
+
+    // The tree may view its own storage, so copies would be invalid.
+    BVH8(BVH8 const&) = delete;
+    BVH8(BVH8&&) = default;
+    BVH8& operator=(BVH8 const&) = delete;
+    BVH8& operator=(BVH8&&) = default;
+
+    BoundingBox const& box() const {
+        return _box;
+    }
+
+    void write(CacheWriter& writer) const {
+        writer.write(_box);
+        writer.writeArray(_nodes);
+        writer.writeArray(_triBlocks);
+    }
+
+    // Finds the nearest intersection with line parameter in [tMin, tMax].
+    template<SurfaceConsideration Surfaces>
+    std::optional<LineTriIntersection> lineTriNearestIntersection(Line const& line, float tMin, float tMax) const {
+        if (_nodes.size() == 0) {
+            return std::nullopt;
+        }
+
+        LineVec8 const lineVec{line};
+        std::optional<LineTriIntersection> nearestIntersection;
+        std::array<StackEntry, STACK_SIZE> stack;
+        std::size_t stackSize = 0;
+        stack[stackSize++] = {0, 0, tMin};
+        while (stackSize > 0) {
+            auto const entry = stack[--stackSize];
+            if (nearestIntersection && entry.tEntry > nearestIntersection->t) {
+                continue;
+            }
+            if (entry.triCount > 0) {
+                leafNearestIntersection<Surfaces>(line, _triBlocks.data() + entry.index, entry.triCount, tMin, tMax,
+                    nearestIntersection);
+                continue;
+            }
+
+            auto const& node = _nodes[entry.index];
+            auto const tNearest = nearestIntersection ? nearestIntersection->t : tMax;
+            auto const [hits, tEntries] = _intersectChildren(lineVec, node, tMin, tNearest);
+
+            // Push the intersected children in far to near order, so the nearest is visited first.
+            std::array<StackEntry, 8> children;
+            unsigned childCount = 0;
+            for (auto mask = hits; mask != 0; mask &= mask - 1) {
+                auto const i = _lowestBit(mask);
+                StackEntry const child{node.children[i], node.triCounts[i], tEntries[i]};
+                auto j = childCount;
+                for (; j > 0 && children[j - 1].tEntry < child.tEntry; --j) {
+                    children[j] = children[j - 1];
+                }
+                children[j] = child;
+                ++childCount;
+            }
+            assert(stackSize + childCount <= stack.size());
+            std::copy_n(children.cbegin(), childCount, stack.begin() + stackSize);
+            stackSize += childCount;
+        }
+        return nearestIntersection;
+    }
+
+    // Checks if a line intersects any tri with line parameter in [tMin, tMax].
+    // Faster than finding the nearest intersection, as traversal stops at the first intersection found.
+    template<SurfaceConsideration Surfaces>
+    bool occluded(Line const& line, float tMin, float tMax) const {
+        if (_nodes.size() == 0) {
+            return false;
+        }
+
+        LineVec8 const lineVec{line};
+        std::array<StackEntry, STACK_SIZE> stack;
+        std::size_t stackSize = 0;
+        stack[stackSize++] = {0, 0, tMin};
+        while (stackSize > 0) {
+            auto const entry = stack[--stackSize];
+            if (entry.triCount > 0) {
+                if (leafOccluded<Surfaces>(line, _triBlocks.data() + entry.index, entry.triCount, tMin, tMax)) {
+                    return true;
+                }
+                continue;
+            }
+
+            // Any intersection will do, so the order of the children doesn't matter.
+            auto const& node = _nodes[entry.index];
+            auto const [hits, tEntries] = _intersectChildren(lineVec, node, tMin, tMax);
+            assert(stackSize + 8 <= stack.size());
+            for (auto mask = hits; mask != 0; mask &= mask - 1) {
+                auto const i = _lowestBit(mask);
+                stack[stackSize++] = {node.children[i], node.triCounts[i], tEntries[i]};
+            }
+        }
+        return false;
+    }
+
+private:
+    // Leaves are stored in their parent node rather than as separate nodes.
+    struct Node {
+        // Child bounding boxes. Unused children have empty boxes (min > max), which are never intersected.
+        FVec8 minX;
+        FVec8 minY;
+        FVec8 minZ;
+        FVec8 maxX;
+        FVec8 maxY;
+        FVec8 maxZ;
+        std::array<std::uint32_t, 8> children;  // Index of the child node, or the leaf's first tri block.
+        std::array<std::uint8_t, 8> triCounts;  // Number of tris in the leaf, or 0 for a child node.
+    };
+
+    // Line broadcast to all elements, preprocessed for box intersection tests.
+    struct LineVec8 {
+        FVec8 originX;
+        FVec8 originY;
+        FVec8 originZ;
+        FVec8 inverseDirectionX;    // Infinite for direction components of 0.
+        FVec8 inverseDirectionY;
+        FVec8 inverseDirectionZ;
+        bool negativeX;             // Whether the line heads in the -ve axis direction, including -0.
+        bool negativeY;
+        bool negativeZ;
+
+        explicit LineVec8(Line const& line) {
+            auto const inverseDirection = 1.0f / line.direction;
+            originX = FVec8{line.origin.x};
+            originY = FVec8{line.origin.y};
+            originZ = FVec8{line.origin.z};
+            inverseDirectionX = FVec8{inverseDirection.x};
+            inverseDirectionY = FVec8{inverseDirection.y};
+            inverseDirectionZ = FVec8{inverseDirection.z};
+            negativeX = inverseDirection.x < 0.0f;
+            negativeY = inverseDirection.y < 0.0f;
+            negativeZ = inverseDirection.z < 0.0f;
+        }
+    };
+
+    struct StackEntry {
+        std::uint32_t index;        // As for Node::children.
+        std::uint32_t triCount;     // As for Node::triCounts.
+        float tEntry;               // Line parameter at which the line enters the child box.
+    };
+
+    struct ChildIntersections {
+        unsigned hits;              // Bitmask of intersected children.
+        FVec8 tEntries;
+    };
+
+    // Leaves with more tris than this are split even if the SAH says it's not worthwhile.
+    constexpr inline static std::size_t MAX_LEAF_TRIS = 32;
+    // Below this depth, nodes are split at the median rather than with the SAH, which bounds the tree depth.
+    constexpr inline static unsigned SAH_DEPTH_LIMIT = 24;
+    // Each level of median splits only splits the children with the largest surface areas, so it's only guaranteed
+    // to halve the tris of the largest child. Meshes have at most std::numeric_limits<TriIndex>::max() tris, so this
+    // bounds the levels of median splits before all children fit in leaves.
+    constexpr inline static unsigned MEDIAN_DEPTH_LIMIT = ceilLog2(
+        (std::uint64_t{std::numeric_limits<TriIndex>::max()} + MAX_LEAF_TRIS - 1) / MAX_LEAF_TRIS);
+    // Each node visited pushes at most 8 entries and pops 1.
+    constexpr inline static std::size_t STACK_SIZE = 7 * (SAH_DEPTH_LIMIT + MEDIAN_DEPTH_LIMIT) + 1;
+
+    BoundingBox _box;
+    std::vector<Node> _nodeStorage;                 // Empty if viewing external data.
+    std::vector<LeafTriBlock> _triBlockStorage;     // Empty if viewing external data.
+    Span<Node const> _nodes;                        // Root is the first node.
+    Span<LeafTriBlock const> _triBlocks;            // Tris of all leaves, each leaf's tris contiguous.
+
+    BVH8(BoundingBox const& box, Span<Node const> nodes, Span<LeafTriBlock const> triBlocks) :
+        _box{box}, _nodeStorage{}, _triBlockStorage{}, _nodes{nodes}, _triBlocks{triBlocks}
+    {}
+
+    static unsigned _lowestBit(unsigned mask) {
+        assert(mask != 0);
+        unsigned bit = 0;
+        while (!(mask & (1u << bit))) {
+            ++bit;
+        }
+        return bit;
+    }
+
+    // Intersects a line with all the child boxes of a node, with line parameter in [tMin, tMax].
+    static ChildIntersections _intersectChildren(LineVec8 const& line, Node const& node, float tMin, float tMax) {
+        // Near and far planes are chosen by the line direction, so that empty boxes are never intersected.
+        // As for lineBoxIntersection(), NaN plane distances of lines lying in a box plane are dropped by passing them
+        // as the first operand of max()/min().
+        auto const tNearX = ((line.negativeX ? node.maxX : node.minX) - line.originX) * line.inverseDirectionX;
+        auto const tNearY = ((line.negativeY ? node.maxY : node.minY) - line.originY) * line.inverseDirectionY;
+        auto const tNearZ = ((line.negativeZ ? node.maxZ : node.minZ) - line.originZ) * line.inverseDirectionZ;
+        auto const tFarX = ((line.negativeX ? node.minX : node.maxX) - line.originX) * line.inverseDirectionX;
+        auto const tFarY = ((line.negativeY ? node.minY : node.maxY) - line.originY) * line.inverseDirectionY;
+        auto const tFarZ = ((line.negativeZ ? node.minZ : node.maxZ) - line.originZ) * line.inverseDirectionZ;
+        auto const tEntry = max(tNearZ, max(tNearY, max(tNearX, FVec8{tMin})));
+        auto const tExit = min(tFarZ, min(tFarY, min(tFarX, FVec8{tMax})));
+        return {bitmask(tEntry <= tExit), tEntry};
+    }
+
+    // Creates a node for a set of tris, appending it and its descendants to the tree. Returns the node's index.
+    // Children are found by repeatedly splitting the child with the largest surface area, until there are 8.
+    std::uint32_t _createNode(Span<PreprocessedTri const> preprocessedTris, Span<BVHBuildReference> references,
+            unsigned depth) {
+        assert(references.size() > 0);
+
+        struct BuildChild {
+            Span<BVHBuildReference> references;
+            BoundingBox bounds;
+            std::optional<BVHObjectSplit> split;    // Best split, if the child should be split.
+            bool splittable;
+        };
+
+        auto const createChild = [depth](Span<BVHBuildReference> childReferences) {
+            BuildChild child{childReferences, referencesBounds(readOnlySpan(childReferences)), std::nullopt, false};
+            if (depth < SAH_DEPTH_LIMIT) {
+                child.split = findObjectSplit(readOnlySpan(childReferences), child.bounds);
+                if (child.split && child.split->cost >= bvhLeafCost(childReferences.size())
+                        && childReferences.size() <= MAX_LEAF_TRIS) {
+                    child.split = std::nullopt;
+                }
+            }
+            child.splittable = child.split || childReferences.size() > MAX_LEAF_TRIS;
+            return child;
+        };
+
+        std::array<BuildChild, 8> children;
+        unsigned childCount = 0;
+        children[childCount++] = createChild(references);
+        while (childCount < 8) {
+            std::optional<unsigned> largest;
+            for (unsigned i = 0; i < childCount; ++i) {
+                if (children[i].splittable
+                        && (!largest || surfaceArea(children[i].bounds) > surfaceArea(children[largest.value()].bounds))) {
+                    largest = i;
+                }
+            }
+            if (!largest) {
+                break;
+            }
+            auto const& child = children[*largest];
+            auto const negativeCount = child.split
+                ? partitionReferences(child.references, *child.split)
+                : medianPartitionReferences(child.references);
+            Span<BVHBuildReference> const negativeReferences{child.references.data(), negativeCount};
+            Span<BVHBuildReference> const positiveReferences{child.references.data() + negativeCount,
+                child.references.size() - negativeCount};
+            children[childCount++] = createChild(positiveReferences);
+            children[*largest] = createChild(negativeReferences);
+        }
+
+        // Reserve the node before recursing so nodes are in depth-first order.
+        auto const nodeIndex = _nodeStorage.size();
+        _nodeStorage.push_back({
+            FVec8{INFINITY}, FVec8{INFINITY}, FVec8{INFINITY},
+            FVec8{-INFINITY}, FVec8{-INFINITY}, FVec8{-INFINITY},
+            {}, {}
+        });
+        for (unsigned i = 0; i < childCount; ++i) {
+            auto const& child = children[i];
+            std::uint32_t childIndex;
+            std::uint8_t triCount = 0;
+            if (child.splittable) {
+                childIndex = _createNode(preprocessedTris, child.references, depth + 1);
+            }
+            else {
+                std::array<std::uint32_t, MAX_LEAF_TRIS> tris{};
+                for (std::size_t j = 0; j < child.references.size(); ++j) {
+                    tris[j] = child.references[j].tri;
+                }
+                childIndex = intCast<std::uint32_t>(_triBlockStorage.size());
+                triCount = intCast<std::uint8_t>(child.references.size());
+                appendLeafTriBlocks(preprocessedTris, Span{tris.data(), child.references.size()}, _triBlockStorage);
+            }
+            // Vector may have been reallocated by the recursion.
+            auto& node = _nodeStorage[nodeIndex];
+            node.minX[i] = child.bounds.min.x;
+            node.minY[i] = child.bounds.min.y;
+            node.minZ[i] = child.bounds.min.z;
+            node.maxX[i] = child.bounds.max.x;
+            node.maxY[i] = child.bounds.max.y;
+            node.maxZ[i] = child.bounds.max.z;
+            node.children[i] = childIndex;
+            node.triCounts[i] = triCount;
+        }
+        return intCast<std::uint32_t>(nodeIndex);
+    }
+};
@@ -0,0 +1,423 @@
+#pragma once
+
+#include "geometry.hpp"
+#include "mesh.hpp"
+#include "utility/span.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <glm/common.hpp>
+#include <glm/vec3.hpp>
+
+
+// Construction of bounding volume hierarchies (BVHs), shared by the BVH variants.
+
+
+// Surface area heuristic (SAH) cost model, used to choose splits and when to stop splitting.
+// Costs are relative to the cost of testing a node's box(es).
+constexpr inline float BVH_TRAVERSAL_COST = 1.0f;
+constexpr inline float BVH_TRI_BLOCK_INTERSECTION_COST = 1.0f;     // Tris are intersected 8 at a time.
+constexpr inline unsigned BVH_SAH_BIN_COUNT = 16;       // Candidate splits are at bin boundaries.
+
+
+// Reference to a tri during construction.
+struct BVHBuildReference {
+    std::uint32_t tri;      // Index into the mesh's tris.
+    BoundingBox bounds;     // Bounding box of the tri.
+    glm::vec3 centre;       // Centre of the bounds.
+};
+
+
+inline unsigned bvhBinIndex(float position, float binsMin, float binScale) {
+    auto const bin = static_cast<int>((position - binsMin) * binScale);
+    return static_cast<unsigned>(std::clamp(bin, 0, static_cast<int>(BVH_SAH_BIN_COUNT) - 1));
+}
+
+
+// Division of tri references into two sets by their centres.
+struct BVHObjectSplit {
+    std::uint8_t axis;      // 0 (X), 1 (Y), 2 (Z)
+    unsigned bin;           // References in bins before this go to the negative side.
+    float binsMin;          // Start of the bins along the axis.
+    float binScale;         // Bins per unit along the axis.
+    float cost;
+    BoundingBox negativeBounds;
+    BoundingBox positiveBounds;
+
+    unsigned binIndex(glm::vec3 const& centre) const {
+        return bvhBinIndex(centre[axis], binsMin, binScale);
+    }
+};
+
+
+inline float bvhLeafCost(std::size_t triCount) {
+    return BVH_TRI_BLOCK_INTERSECTION_COST * ((triCount + 7) / 8);
+}
+
+
+inline BoundingBox referencesBounds(Span<BVHBuildReference const> references) {
+    BoundingBox box{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+    for (auto const& reference : references) {
+        box.min = glm::min(box.min, reference.bounds.min);
+        box.max = glm::max(box.max, reference.bounds.max);
+    }
+    return box;
+}
+
+
+// Finds the split of the references by their centres with the lowest SAH cost.
+// No split is possible if all the centres coincide.
+inline std::optional<BVHObjectSplit> findObjectSplit(Span<BVHBuildReference const> references,
+        BoundingBox const& bounds) {
+    auto const boundsArea = surfaceArea(bounds);
+    if (references.size() < 2 || !(boundsArea > 0.0f)) {
+        return std::nullopt;
+    }
+
+    BoundingBox centreBounds{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+    for (auto const& reference : references) {
+        centreBounds.min = glm::min(centreBounds.min, reference.centre);
+        centreBounds.max = glm::max(centreBounds.max, reference.centre);
+    }
+
+    struct Bin {
+        BoundingBox bounds{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+        std::size_t count = 0;
+    };
+
+    std::optional<BVHObjectSplit> best;
+    for (std::uint8_t axis = 0; axis < 3; ++axis) {
+        auto const extent = centreBounds.max[axis] - centreBounds.min[axis];
+        if (!(extent > 0.0f)) {
+            continue;
+        }
+        auto const binsMin = centreBounds.min[axis];
+        auto const binScale = BVH_SAH_BIN_COUNT / extent;
+
+        std::array<Bin, BVH_SAH_BIN_COUNT> bins{};
+        for (auto const& reference : references) {
+            auto& bin = bins[bvhBinIndex(reference.centre[axis], binsMin, binScale)];
+            bin.bounds.min = glm::min(bin.bounds.min, reference.bounds.min);
+            bin.bounds.max = glm::max(bin.bounds.max, reference.bounds.max);
+            ++bin.count;
+        }
+
+        // Sweep from the positive end to find the bounds and count of the positive side of each split, then from the
+        // negative end to evaluate each split.
+        std::array<Bin, BVH_SAH_BIN_COUNT> positives{};
+        std::array<float, BVH_SAH_BIN_COUNT> positiveCosts{};
+        {
+            Bin positive;
+            for (auto bin = BVH_SAH_BIN_COUNT - 1; bin > 0; --bin) {
+                positive.bounds.min = glm::min(positive.bounds.min, bins[bin].bounds.min);
+                positive.bounds.max = glm::max(positive.bounds.max, bins[bin].bounds.max);
+                positive.count += bins[bin].count;
+                positives[bin] = positive;
+                positiveCosts[bin] = positive.count > 0
+                    ? surfaceArea(positive.bounds) * bvhLeafCost(positive.count) : 0.0f;
+            }
+        }
+        Bin negative;
+        for (unsigned bin = 1; bin < BVH_SAH_BIN_COUNT; ++bin) {
+            negative.bounds.min = glm::min(negative.bounds.min, bins[bin - 1].bounds.min);
+            negative.bounds.max = glm::max(negative.bounds.max, bins[bin - 1].bounds.max);
+            negative.count += bins[bin - 1].count;
+            if (negative.count == 0 || positives[bin].count == 0) {
+                continue;
+            }
+            auto const cost = BVH_TRAVERSAL_COST
+                + (surfaceArea(negative.bounds) * bvhLeafCost(negative.count) + positiveCosts[bin]) / boundsArea;
+            if (!best || cost < best->cost) {
+                best = {axis, bin, binsMin, binScale, cost, negative.bounds, positives[bin].bounds};
+            }
+        }
+    }
+    return best;
+}
+
+
+// Spreads the low 21 bits of a value out so there are 2 zero bits between each bit.
+inline std::uint64_t spreadMortonBits(std::uint64_t value) {
+    value &= 0x1FFFFF;
+    value = (value | (value << 32)) & 0x001F00000000FFFF;
+    value = (value | (value << 16)) & 0x001F0000FF0000FF;
+    value = (value | (value << 8)) & 0x100F00F00F00F00F;
+    value = (value | (value << 4)) & 0x10C30C30C30C30C3;
+    value = (value | (value << 2)) & 0x1249249249249249;
+    return value;
+}
+
+
+// Computes the 63 bit Morton code of a point, which orders points along a Z-order curve through the bounds. Nearby
+// points tend to have similar codes.
+// All axes are scaled by the largest extent of the bounds, so cells are cubes. Scaling each axis by its own extent
+// would give a thin axis as many bits as the long ones, so for flat or elongated bounds, the highest bits (which
+// linear BVH construction splits by first) would divide along the thin axis.
+inline std::uint64_t mortonCode(glm::vec3 const& point, BoundingBox const& bounds) {
+    constexpr float CELLS = 1 << 21;
+    auto const extent = bounds.max - bounds.min;
+    auto const maxExtent = std::max(std::max(extent.x, extent.y), extent.z);
+    std::array<std::uint64_t, 3> cells{};
+    for (unsigned axis = 0; axis < 3; ++axis) {
+        auto const normalised = maxExtent > 0.0f ? (point[axis] - bounds.min[axis]) / maxExtent : 0.0f;
+        cells[axis] = static_cast<std::uint64_t>(std::clamp(normalised * CELLS, 0.0f, CELLS - 1.0f));
+    }
+    return (spreadMortonBits(cells[0]) << 2) | (spreadMortonBits(cells[1]) << 1) | spreadMortonBits(cells[2]);
+}
+
+
+// Partitions the references by a split. Returns the number of references on the negative side, which are first.
+inline std::size_t partitionReferences(Span<BVHBuildReference> references, BVHObjectSplit const& split) {
+    auto const middle = std::partition(references.begin(), references.end(),
+        [&split](BVHBuildReference const& reference) { return split.binIndex(reference.centre) < split.bin; });
+    return static_cast<std::size_t>(middle - references.begin());
+}
+
+
+// Partitions the references into halves by their centres along the axis of greatest extent, for when there is no
+// good split. Returns the number of references on the negative side, which are first.
+inline std::size_t medianPartitionReferences(Span<BVHBuildReference> references) {
+    BoundingBox centreBounds{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+    for (auto const& reference : references) {
+        centreBounds.min = glm::min(centreBounds.min, reference.centre);
+        centreBounds.max = glm::max(centreBounds.max, reference.centre);
+    }
+    auto const extent = centreBounds.max - centreBounds.min;
+    auto const axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    auto const middle = references.begin() + references.size() / 2;
+    std::nth_element(references.begin(), middle, references.end(),
+        [axis](BVHBuildReference const& a, BVHBuildReference const& b) { return a.centre[axis] < b.centre[axis]; });
+    return references.size() / 2;
+}
+
+
+// SPATIAL SPLITS:
+//   References may also be divided by a plane, with references straddling the plane clipped to each side, which
+//   duplicates them. This helps when large tris overlap many smaller ones, which object splits can't separate.
+//   See M. Stich et al., "Spatial Splits in Bounding Volume Hierarchies", 2009.
+
+// Spatial splits are only tried if the children of the best object split overlap by more than this fraction of the
+// root's surface area.
+constexpr inline float SBVH_OVERLAP_THRESHOLD = 1e-5f;
+// Maximum number of references added by spatial splits, as a fraction of the tri count.
+constexpr inline float SBVH_DUPLICATION_BUDGET = 0.5f;
+
+
+// Division of tri references into two sets by a plane perpendicular to an axis.
+struct BVHSpatialSplit {
+    std::uint8_t axis;      // 0 (X), 1 (Y), 2 (Z)
+    float position;         // Position of the plane along the axis.
+    float cost;
+};
+
+
+// Computes the bounds of the part of a tri between two planes perpendicular to an axis. Empty (min > max) if the tri
+// is entirely outside the planes.
+inline BoundingBox clippedTriBounds(Tri const& tri, std::uint8_t axis, float min, float max) {
+    BoundingBox box{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+    auto const include = [&box](glm::vec3 const& point) {
+        box.min = glm::min(box.min, point);
+        box.max = glm::max(box.max, point);
+    };
+
+    std::array<glm::vec3, 3> const vertices{tri.v1, tri.v2, tri.v3};
+    for (std::size_t i = 0; i < 3; ++i) {
+        auto const& v1 = vertices[i];
+        auto const& v2 = vertices[(i + 1) % 3];
+        if (v1[axis] >= min && v1[axis] <= max) {
+            include(v1);
+        }
+        // Points where the edge crosses the planes.
+        for (auto const plane : {min, max}) {
+            if ((v1[axis] < plane && v2[axis] > plane) || (v1[axis] > plane && v2[axis] < plane)) {
+                auto point = v1 + (v2 - v1) * ((plane - v1[axis]) / (v2[axis] - v1[axis]));
+                point[axis] = plane;
+                include(point);
+            }
+        }
+    }
+    return box;
+}
+
+
+inline bool boxEmpty(BoundingBox const& box) {
+    return !(box.min.x <= box.max.x && box.min.y <= box.max.y && box.min.z <= box.max.z);
+}
+
+
+inline Tri referenceTri(Span<glm::vec3 const> vertexPositions, Span<IndexedTri const> tris,
+        BVHBuildReference const& reference) {
+    auto const& tri = tris[reference.tri];
+    return {vertexPositions[tri.v1], vertexPositions[tri.v2], vertexPositions[tri.v3]};
+}
+
+
+// Computes the bounds of the part of a reference between two planes perpendicular to an axis.
+inline BoundingBox clippedReferenceBounds(Span<glm::vec3 const> vertexPositions, Span<IndexedTri const> tris,
+        BVHBuildReference const& reference, std::uint8_t axis, float min, float max) {
+    auto const clipped = clippedTriBounds(referenceTri(vertexPositions, tris, reference), axis,
+        std::max(min, reference.bounds.min[axis]), std::min(max, reference.bounds.max[axis]));
+    // The reference may already have been clipped by other planes.
+    return boxIntersection(clipped, reference.bounds);
+}
+
+
+// Finds the spatial split of the references with the lowest SAH cost which adds at most maxDuplicates references.
+inline std::optional<BVHSpatialSplit> findSpatialSplit(Span<glm::vec3 const> vertexPositions,
+        Span<IndexedTri const> tris, Span<BVHBuildReference const> references, BoundingBox const& bounds,
+        std::size_t maxDuplicates) {
+    auto const boundsArea = surfaceArea(bounds);
+    if (references.size() < 2 || !(boundsArea > 0.0f)) {
+        return std::nullopt;
+    }
+
+    struct Bin {
+        BoundingBox bounds{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+        std::size_t entries = 0;    // Number of references starting in the bin.
+        std::size_t exits = 0;      // Number of references ending in the bin.
+    };
+
+    std::optional<BVHSpatialSplit> best;
+    for (std::uint8_t axis = 0; axis < 3; ++axis) {
+        auto const extent = bounds.max[axis] - bounds.min[axis];
+        if (!(extent > 0.0f)) {
+            continue;
+        }
+        auto const binsMin = bounds.min[axis];
+        auto const binScale = BVH_SAH_BIN_COUNT / extent;
+        auto const binPosition = [binsMin, extent](unsigned bin) {
+            return binsMin + extent * bin / BVH_SAH_BIN_COUNT;
+        };
+
+        // Each reference is clipped to each bin it overlaps.
+        std::array<Bin, BVH_SAH_BIN_COUNT> bins{};
+        for (auto const& reference : references) {
+            auto const firstBin = bvhBinIndex(reference.bounds.min[axis], binsMin, binScale);
+            auto const lastBin = bvhBinIndex(reference.bounds.max[axis], binsMin, binScale);
+            ++bins[firstBin].entries;
+            ++bins[lastBin].exits;
+            for (auto bin = firstBin; bin <= lastBin; ++bin) {
+                auto const clipped = firstBin == lastBin ? reference.bounds
+                    : clippedReferenceBounds(vertexPositions, tris, reference, axis, binPosition(bin),
+                        binPosition(bin + 1));
+                bins[bin].bounds.min = glm::min(bins[bin].bounds.min, clipped.min);
+                bins[bin].bounds.max = glm::max(bins[bin].bounds.max, clipped.max);
+            }
+        }
+
+        // Sweep as for object splits. References are on the negative side of a split if they start before it and on
+        // the positive side if they end after it.
+        std::array<float, BVH_SAH_BIN_COUNT> positiveCosts{};
+        std::array<std::size_t, BVH_SAH_BIN_COUNT> positiveCounts{};
+        {
+            BoundingBox positiveBounds{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+            std::size_t positiveCount = 0;
+            for (auto bin = BVH_SAH_BIN_COUNT - 1; bin > 0; --bin) {
+                positiveBounds.min = glm::min(positiveBounds.min, bins[bin].bounds.min);
+                positiveBounds.max = glm::max(positiveBounds.max, bins[bin].bounds.max);
+                positiveCount += bins[bin].exits;
+                positiveCounts[bin] = positiveCount;
+                positiveCosts[bin] = positiveCount > 0
+                    ? surfaceArea(positiveBounds) * bvhLeafCost(positiveCount) : 0.0f;
+            }
+        }
+        BoundingBox negativeBounds{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+        std::size_t negativeCount = 0;
+        for (unsigned bin = 1; bin < BVH_SAH_BIN_COUNT; ++bin) {
+            negativeBounds.min = glm::min(negativeBounds.min, bins[bin - 1].bounds.min);
+            negativeBounds.max = glm::max(negativeBounds.max, bins[bin - 1].bounds.max);
+            negativeCount += bins[bin - 1].entries;
+            auto const positiveCount = positiveCounts[bin];
+            if (negativeCount == 0 || positiveCount == 0
+                    || negativeCount + positiveCount > references.size() + maxDuplicates) {
+                continue;
+            }
+            auto const cost = BVH_TRAVERSAL_COST
+                + (surfaceArea(negativeBounds) * bvhLeafCost(negativeCount) + positiveCosts[bin]) / boundsArea;
+            if (!best || cost < best->cost) {
+                best = {axis, binPosition(bin), cost};
+            }
+        }
+    }
+    return best;
+}
+
+
+// Divides the references by a spatial split. References straddling the split are clipped to both sides, unless
+// putting them entirely on one side is estimated to be cheaper ("reference unsplitting").
+// Returns the negative and positive side references.
+inline std::pair<std::vector<BVHBuildReference>, std::vector<BVHBuildReference>> spatialPartitionReferences(
+        Span<glm::vec3 const> vertexPositions, Span<IndexedTri const> tris, Span<BVHBuildReference const> references,
+        BVHSpatialSplit const& split) {
+    auto const axis = split.axis;
+    std::vector<BVHBuildReference> negative;
+    std::vector<BVHBuildReference> positive;
+    std::vector<BVHBuildReference> straddling;
+    BoundingBox negativeBounds{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+    BoundingBox positiveBounds{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+    auto const add = [](std::vector<BVHBuildReference>& side, BoundingBox& sideBounds,
+            BVHBuildReference const& reference) {
+        side.push_back(reference);
+        sideBounds.min = glm::min(sideBounds.min, reference.bounds.min);
+        sideBounds.max = glm::max(sideBounds.max, reference.bounds.max);
+    };
+    auto const merged = [](BoundingBox const& box1, BoundingBox const& box2) {
+        return BoundingBox{glm::min(box1.min, box2.min), glm::max(box1.max, box2.max)};
+    };
+
+    for (auto const& reference : references) {
+        if (reference.bounds.max[axis] <= split.position) {
+            add(negative, negativeBounds, reference);
+        }
+        else if (reference.bounds.min[axis] >= split.position) {
+            add(positive, positiveBounds, reference);
+        }
+        else {
+            straddling.push_back(reference);
+        }
+    }
+
+    for (auto const& reference : straddling) {
+        auto negativePart = reference;
+        negativePart.bounds = clippedReferenceBounds(vertexPositions, tris, reference, axis, -INFINITY,
+            split.position);
+        negativePart.centre = (negativePart.bounds.min + negativePart.bounds.max) * 0.5f;
+        auto positivePart = reference;
+        positivePart.bounds = clippedReferenceBounds(vertexPositions, tris, reference, axis, split.position,
+            INFINITY);
+        positivePart.centre = (positivePart.bounds.min + positivePart.bounds.max) * 0.5f;
+
+        // A reference may only be moved entirely to one side if the other side is not empty.
+        auto const negativeCount = static_cast<float>(negative.size());
+        auto const positiveCount = static_cast<float>(positive.size());
+        auto const splitCost = surfaceArea(merged(negativeBounds, negativePart.bounds)) * (negativeCount + 1.0f)
+            + surfaceArea(merged(positiveBounds, positivePart.bounds)) * (positiveCount + 1.0f);
+        auto const negativeCost = positive.empty() ? INFINITY
+            : surfaceArea(merged(negativeBounds, reference.bounds)) * (negativeCount + 1.0f)
+                + surfaceArea(positiveBounds) * positiveCount;
+        auto const positiveCost = negative.empty() ? INFINITY
+            : surfaceArea(negativeBounds) * negativeCount
+                + surfaceArea(merged(positiveBounds, reference.bounds)) * (positiveCount + 1.0f);
+
+        // Clipping may produce an empty part if the tri only touches the plane.
+        auto const negativeEmpty = boxEmpty(negativePart.bounds);
+        auto const positiveEmpty = boxEmpty(positivePart.bounds);
+        if (positiveEmpty || (!negativeEmpty && negativeCost <= splitCost && negativeCost <= positiveCost)) {
+            add(negative, negativeBounds, reference);
+        }
+        else if (negativeEmpty || positiveCost <= splitCost) {
+            add(positive, positiveBounds, reference);
+        }
+        else {
+            add(negative, negativeBounds, negativePart);
+            add(positive, positiveBounds, positivePart);
+        }
+    }
+    return {std::move(negative), std::move(positive)};
+}
@@ -5,13 +5,13 @@
 #include "utility/vectorised.hpp"
 
 #include <algorithm>
-#include <cassert>
 #include <cmath>
-#include <optional>
 
 #include <glm/common.hpp>
 #include <glm/geometric.hpp>
+#include <glm/mat4x3.hpp>
 #include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
 
 
 // Axis-aligned bounding box.
@@ -92,6 +92,43 @@ inline BoundingBox computeBoundingBox(Span<glm::vec3 const> points) {
 }
 
 
+inline BoundingBox computeBoundingBox(Tri const& tri) {
+    return {glm::min(glm::min(tri.v1, tri.v2), tri.v3), glm::max(glm::max(tri.v1, tri.v2), tri.v3)};
+}
+
+
+// Computes the box which is the overlap of two boxes. Result is not valid if the boxes don't overlap.
+inline BoundingBox boxIntersection(BoundingBox const& box1, BoundingBox const& box2) {
+    return {glm::max(box1.min, box2.min), glm::min(box1.max, box2.max)};
+}
+
+
+// Computes the bounding box of a box after an affine transformation.
+inline BoundingBox transformBoundingBox(BoundingBox const& box, glm::mat4x3 const& transform) {
+    auto const centre = transform * glm::vec4{(box.min + box.max) / 2.0f, 1.0f};
+    auto const radius = (box.max - box.min) / 2.0f;
+    auto const transformedRadius = glm::abs(transform[0]) * radius.x + glm::abs(transform[1]) * radius.y
+        + glm::abs(transform[2]) * radius.z;
+    return {centre - transformedRadius, centre + transformedRadius};
+}
+
+
+// Applies the linear part of an affine transformation to 8 directions.
+inline FVec3_8 transformDirections(FVec3_8 const& directions, glm::mat4x3 const& transform) {
+    auto const transformComponent = [&directions, &transform](unsigned component) {
+        return fma(FVec8{transform[0][component]}, directions.x,
+            fma(FVec8{transform[1][component]}, directions.y, FVec8{transform[2][component]} * directions.z));
+    };
+    return {transformComponent(0), transformComponent(1), transformComponent(2)};
+}
+
+
+inline float surfaceArea(BoundingBox const& box) {
+    auto const size = box.max - box.min;
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+
 template<SurfaceConsideration Surfaces>
 LineTrisIntersection lineTrisIntersection(Line line, PreprocessedTriBlock tris);
 
@@ -132,85 +169,120 @@ inline LineTrisIntersection lineTrisIntersection<SurfaceConsideration::FRONT_ONL
 }
 
 
-inline bool lineIntersectsBox(Line const& line, BoundingBox const& box) {
-    auto const linePlaneIntersection = [](float nDotD, float p0MinusL0DotN) -> std::optional<float> {
-        if (std::abs(nDotD) < 1e-6f) {
-            return std::nullopt;
-        }
-        else {
-            auto const t = p0MinusL0DotN / nDotD;
-            if (t >= 0.0f) {
-                return {t};
-            }
-            else {
-                return std::nullopt;
-            }
-        }
+// Line preprocessed for box intersection tests, for efficiency.
+struct PreprocessedLine {
+    FVec4 origin;
+    FVec4 inverseDirection;     // Infinite for direction components of 0.
+    U32Vec4 negativeDirection;  // Set for direction components heading in the -ve axis direction, including -0.
+};
+
+
+inline PreprocessedLine preprocessLine(Line const& line) {
+    auto const inverseDirection = FVec4{1.0f} / FVec4{line.direction.x, line.direction.y, line.direction.z, 1.0f};
+    return {
+        FVec4{line.origin.x, line.origin.y, line.origin.z, 0.0f},
+        inverseDirection,
+        inverseDirection < FVec4{0.0f}
     };
+}
 
-    assert(isUnitVector(line.direction));
 
-    // -X face
-    if (auto const t = linePlaneIntersection(-line.direction.x, line.origin.x - box.min.x)) {
-        auto const y = line.origin.y + *t * line.direction.y;
-        if (y >= box.min.y && y <= box.max.y) {
-            auto const z = line.origin.z + *t * line.direction.z;
-            if (z >= box.min.z && z <= box.max.z) {
-                return true;
-            }
-        }
-    }
-    // +X face
-    if (auto const t = linePlaneIntersection(line.direction.x, box.max.x - line.origin.x)) {
-        auto const y = line.origin.y + *t * line.direction.y;
-        if (y >= box.min.y && y <= box.max.y) {
-            auto const z = line.origin.z + *t * line.direction.z;
-            if (z >= box.min.z && z <= box.max.z) {
-                return true;
-            }
-        }
-    }
-    // -Y face
-    if (auto const t = linePlaneIntersection(-line.direction.y, line.origin.y - box.min.y)) {
-        auto const x = line.origin.x + *t * line.direction.x;
-        if (x >= box.min.x && x <= box.max.x) {
-            auto const z = line.origin.z + *t * line.direction.z;
-            if (z >= box.min.z && z <= box.max.z) {
-                return true;
-            }
-        }
-    }
-    // +Y face
-    if (auto const t = linePlaneIntersection(line.direction.y, box.max.y - line.origin.y)) {
-        auto const x = line.origin.x + *t * line.direction.x;
-        if (x >= box.min.x && x <= box.max.x) {
-            auto const z = line.origin.z + *t * line.direction.z;
-            if (z >= box.min.z && z <= box.max.z) {
-                return true;
-            }
-        }
+// Range of line parameters over which a line is inside a box. Empty if entry > exit.
+struct LineBoxInterval {
+    float entry;
+    float exit;
+
+    bool empty() const {
+        return !(entry <= exit);
     }
-    // -Z face
-    if (auto const t = linePlaneIntersection(-line.direction.z, line.origin.z - box.min.z)) {
-        auto const x = line.origin.x + *t * line.direction.x;
-        if (x >= box.min.x && x <= box.max.x) {
-            auto const y = line.origin.y + *t * line.direction.y;
-            if (y >= box.min.y && y <= box.max.y) {
-                return true;
-            }
-        }
+};
+
+
+// Finds the range of line parameters, within [tMin, tMax], over which a line is inside a box.
+// Branchless slab test: the distances to the 3 pairs of box planes are computed at once.
+// A line lying in a box plane, parallel to the axis, has a plane distance of 0 * infinity = NaN. It's then inside that
+// slab for all parameters, so NaN distances are passed as the first operand of max()/min(), which drops them.
+inline LineBoxInterval lineBoxIntersection(PreprocessedLine const& line, BoundingBox const& box,
+        float tMin, float tMax) {
+    FVec4 const boxMin{box.min.x, box.min.y, box.min.z, 0.0f};
+    FVec4 const boxMax{box.max.x, box.max.y, box.max.z, 0.0f};
+    auto const tNear = (conditional(line.negativeDirection, boxMax, boxMin) - line.origin) * line.inverseDirection;
+    auto const tFar = (conditional(line.negativeDirection, boxMin, boxMax) - line.origin) * line.inverseDirection;
+    return {
+        max3(max(tNear, FVec4{tMin})),
+        min3(min(tFar, FVec4{tMax}))
+    };
+}
+
+
+constexpr inline unsigned LINE_PACKET_SIZE = 8;
+
+
+// Lines with a common origin, such as camera rays, which are traced together for efficiency.
+struct LinePacket {
+    glm::vec3 origin;
+    FVec3_8 directions;
+
+    Line line(unsigned index) const {
+        return {origin, directions.extract(index)};
     }
-    // +Z face
-    if (auto const t = linePlaneIntersection(line.direction.z, box.max.z - line.origin.z)) {
-        auto const x = line.origin.x + *t * line.direction.x;
-        if (x >= box.min.x && x <= box.max.x) {
-            auto const y = line.origin.y + *t * line.direction.y;
-            if (y >= box.min.y && y <= box.max.y) {
-                return true;
-            }
-        }
+};
+
+
+// Line packet preprocessed for box intersection tests, for efficiency.
+struct PreprocessedLinePacket {
+    glm::vec3 origin;
+    FVec3_8 inverseDirections;  // Infinite for direction components of 0.
+    U32Vec8 negativeX;          // Set for lines heading in the -ve axis direction, including -0.
+    U32Vec8 negativeY;
+    U32Vec8 negativeZ;
+};
+
+
+inline PreprocessedLinePacket preprocessLinePacket(LinePacket const& lines) {
+    FVec3_8 const inverseDirections{1.0f / lines.directions.x, 1.0f / lines.directions.y, 1.0f / lines.directions.z};
+    return {
+        lines.origin,
+        inverseDirections,
+        inverseDirections.x < FVec8{0.0f},
+        inverseDirections.y < FVec8{0.0f},
+        inverseDirections.z < FVec8{0.0f}
+    };
+}
+
+
+// Ranges of line parameters over which each line of a packet is inside a box. Empty for a line if entry > exit.
+struct LinePacketBoxIntervals {
+    FVec8 entry;
+    FVec8 exit;
+
+    // Bitmask of the lines with nonempty ranges.
+    unsigned nonEmpty() const {
+        return bitmask(entry <= exit);
     }
-    return false;
+};
+
+
+// Finds the ranges of line parameters, within [tMin, tMax], over which each line of a packet is inside a box.
+// NaN plane distances are dropped as for lineBoxIntersection().
+inline LinePacketBoxIntervals linePacketBoxIntersection(PreprocessedLinePacket const& lines, BoundingBox const& box,
+        FVec8 tMin, FVec8 tMax) {
+    auto const minX = FVec8{box.min.x - lines.origin.x};
+    auto const maxX = FVec8{box.max.x - lines.origin.x};
+    auto const minY = FVec8{box.min.y - lines.origin.y};
+    auto const maxY = FVec8{box.max.y - lines.origin.y};
+    auto const minZ = FVec8{box.min.z - lines.origin.z};
+    auto const maxZ = FVec8{box.max.z - lines.origin.z};
+    auto const tNearX = conditional(lines.negativeX, maxX, minX) * lines.inverseDirections.x;
+    auto const tNearY = conditional(lines.negativeY, maxY, minY) * lines.inverseDirections.y;
+    auto const tNearZ = conditional(lines.negativeZ, maxZ, minZ) * lines.inverseDirections.z;
+    auto const tFarX = conditional(lines.negativeX, minX, maxX) * lines.inverseDirections.x;
+    auto const tFarY = conditional(lines.negativeY, minY, maxY) * lines.inverseDirections.y;
+    auto const tFarZ = conditional(lines.negativeZ, minZ, maxZ) * lines.inverseDirections.z;
+    return {
+        max(tNearZ, max(tNearY, max(tNearX, tMin))),
+        min(tFarZ, min(tFarY, min(tFarX, tMax)))
+    };
 }
 
 
@@ -2,6 +2,8 @@
 
 #include "utility/math.hpp"
 #include "utility/span.hpp"
+#include "utility/vectorised.hpp"
+#include "utility/vectorised_math.hpp"
 
 #include <algorithm>
 #include <array>
@@ -12,6 +14,16 @@
 #include <glm/vec3.hpp>
 
 
+// Relative luminance of a linear RGB colour (Rec. 709 primaries).
+inline float luminance(glm::vec3 linear) {
+    return 0.2126f * linear.r + 0.7152f * linear.g + 0.0722f * linear.b;
+}
+
+
+inline float reinhardToneMap(float hdr) {
+    return hdr / (1.0f + hdr);
+}
+
 inline glm::vec3 reinhardToneMap(glm::vec3 hdr) {
     return hdr / (1.0f + hdr);
 }
@@ -26,8 +38,12 @@ inline float linearToSRGB(float linear) {
     }
 }
 
+// Same as linearToSRGB(float) for each component, up to float rounding, but vectorised.
 inline glm::vec3 linearToSRGB(glm::vec3 linear) {
-    return {linearToSRGB(linear.r), linearToSRGB(linear.g), linearToSRGB(linear.b)};
+    FVec4 const values{linear.r, linear.g, linear.b, 1.0f};     // 4th element is unused.
+    auto const curve = FVec4{1.055f} * pow(values, FVec4{1.0f / 2.4f}) - FVec4{0.055f};
+    auto const result = conditional(FVec4{0.0031308f} < values, curve, values * 12.92f);
+    return {result[0], result[1], result[2]};
 }
 
 
@@ -40,8 +56,12 @@ inline float srgbToLinear(float srgb) {
     }
 }
 
+// Same as srgbToLinear(float) for each component, up to float rounding, but vectorised.
 inline glm::vec3 srgbToLinear(glm::vec3 srgb) {
-    return {srgbToLinear(srgb.r), srgbToLinear(srgb.g), srgbToLinear(srgb.b)};
+    FVec4 const values{srgb.r, srgb.g, srgb.b, 1.0f};   // 4th element is unused.
+    auto const curve = pow((values + FVec4{0.055f}) / 1.055f, FVec4{2.4f});
+    auto const result = conditional(FVec4{0.04045f} < values, curve, values / 12.92f);
+    return {result[0], result[1], result[2]};
 }
 
 
@@ -5,8 +5,9 @@
 #include <cstdint>
 
 
-using VertexIndex = std::uint16_t;
-using TriIndex = std::uint16_t;
+// Indices within a single mesh, which may have millions of tris.
+using VertexIndex = std::uint32_t;
+using TriIndex = std::uint32_t;
 using MeshIndex = std::uint16_t;
 using MaterialIndex = std::uint16_t;
 
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "geometry.hpp"
+#include "index_types.hpp"
+#include "utility/numeric.hpp"
+#include "utility/span.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+
+// Leaf tri storage and intersection shared by the mesh acceleration structures.
+
+
+// Represents an intersection of a line and a tri of a mesh.
+struct LineTriIntersection {
+    float t;                    // Line equation parameter.
+    float pointCoord2;          // Barycentric coordinate relative to vertex 2.
+    float pointCoord3;          // Barycentric coordinate relative to vertex 3.
+    glm::vec3 point;            // Intersection point.
+    TriIndex tri;               // Index of intersected tri.
+};
+
+
+// 8 tris of a leaf, with their mesh tri indices. A leaf's tris are stored as a contiguous range of blocks.
+struct LeafTriBlock {
+    PreprocessedTriBlock tris;
+    std::array<TriIndex, 8> triIndices;
+};
+
+
+// Appends the blocks for a leaf's tris. Tris are given as indices into the mesh's preprocessed tris.
+template<typename TriIndices>
+void appendLeafTriBlocks(Span<PreprocessedTri const> meshTris, TriIndices const& leafTris,
+        std::vector<LeafTriBlock>& blocks) {
+    auto const triCount = leafTris.size();
+    auto const blockCount = (triCount + 7) / 8;
+    for (std::size_t i = 0; i < blockCount; ++i) {
+        // Unused slots of the last block are zero tris, which are never intersected.
+        std::array<PreprocessedTri, 8> tris{};
+        std::array<TriIndex, 8> triIndices{};
+        for (std::size_t j = 0; j < 8 && i * 8 + j < triCount; ++j) {
+            auto const tri = leafTris[i * 8 + j];
+            tris[j] = meshTris[tri];
+            triIndices[j] = intCast<TriIndex>(tri);
+        }
+        blocks.push_back({{
+            {
+                tris[0].normal, tris[1].normal, tris[2].normal, tris[3].normal,
+                tris[4].normal, tris[5].normal, tris[6].normal, tris[7].normal
+            },
+            {
+                tris[0].v1, tris[1].v1, tris[2].v1, tris[3].v1,
+                tris[4].v1, tris[5].v1, tris[6].v1, tris[7].v1
+            },
+            {
+                tris[0].v1ToV2, tris[1].v1ToV2, tris[2].v1ToV2, tris[3].v1ToV2,
+                tris[4].v1ToV2, tris[5].v1ToV2, tris[6].v1ToV2, tris[7].v1ToV2
+            },
+            {
+                tris[0].v1ToV3, tris[1].v1ToV3, tris[2].v1ToV3, tris[3].v1ToV3,
+                tris[4].v1ToV3, tris[5].v1ToV3, tris[6].v1ToV3, tris[7].v1ToV3
+            }
+        }, triIndices});
+    }
+}
+
+
+// Updates the nearest intersection with the tris in a leaf, with line parameter in [tMin, tMax].
+template<SurfaceConsideration Surfaces>
+void leafNearestIntersection(Line const& line, LeafTriBlock const* blocks, std::uint32_t triCount, float tMin,
+        float tMax, std::optional<LineTriIntersection>& nearestIntersection) {
+    assert(triCount > 0);
+    auto const blockCount = (triCount + 7u) / 8u;
+    for (unsigned blockIndex = 0; blockIndex < blockCount; ++blockIndex) {
+        auto const& block = blocks[blockIndex];
+        auto const intersections = lineTrisIntersection<Surfaces>(line, block.tris);
+        auto const blockTriCount = std::min(triCount - blockIndex * 8, 8u);
+        for (unsigned i = 0; i < blockTriCount; ++i) {
+            if (intersections.exists[i]) {
+                auto const t = intersections.t[i];
+                if (t >= tMin && t <= tMax && (!nearestIntersection || t < nearestIntersection->t)) {
+                    nearestIntersection = {
+                        t, intersections.pointCoord2[i], intersections.pointCoord3[i],
+                        line(t), block.triIndices[i]};
+                }
+            }
+        }
+    }
+}
+
+
+// Checks if a line intersects any tri in a leaf with line parameter in [tMin, tMax].
+template<SurfaceConsideration Surfaces>
+bool leafOccluded(Line const& line, LeafTriBlock const* blocks, std::uint32_t triCount, float tMin, float tMax) {
+    assert(triCount > 0);
+    auto const blockCount = (triCount + 7u) / 8u;
+    for (unsigned i = 0; i < blockCount; ++i) {
+        auto const intersections = lineTrisIntersection<Surfaces>(line, blocks[i].tris);
+        if (any(intersections.exists & (intersections.t >= tMin) & (intersections.t <= tMax))) {
+            return true;
+        }
+    }
+    return false;
+}
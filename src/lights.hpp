@@ -0,0 +1,128 @@
+#pragma once
+
+#include "geometry.hpp"
+#include "index_types.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+#include "utility/numeric.hpp"
+#include "utility/permuted_span.hpp"
+#include "utility/random.hpp"
+#include "utility/span.hpp"
+#include "utility/vectorised.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include <glm/geometric.hpp>
+#include <glm/mat4x3.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+
+// Point sampled on a light source.
+struct LightSample {
+    glm::vec3 point;
+    glm::vec3 normal;           // Unit normal of the light's front surface.
+    FastFVec3 emission;
+};
+
+
+// Tris of emissive models, for sampling light sources directly.
+// Tris are chosen with probability proportional to their area, so the area density of sampled points is uniform over
+// all light sources.
+class Lights {
+public:
+    Lights(Span<glm::vec3 const> vertexPositions, PermutedSpan<VertexRange const, MeshIndex> vertexRanges,
+            Span<IndexedTri const> tris, PermutedSpan<TriRange const, MeshIndex> triRanges,
+            Span<MeshTransform const> modelTransforms, PermutedSpan<PreprocessedMaterial const, MeshIndex> materials) :
+        _tris{}, _cumulativeAreas{}, _modelTriOffsets{}, _totalArea{0.0f}
+    {
+        assert(vertexRanges.size() == modelTransforms.size());
+        assert(triRanges.size() == modelTransforms.size());
+        assert(materials.size() == modelTransforms.size());
+
+        auto const modelCount = intCast<MeshIndex>(modelTransforms.size());
+        _modelTriOffsets.resize(modelCount, NOT_EMISSIVE);
+        for (MeshIndex modelIndex = 0; modelIndex < modelCount; ++modelIndex) {
+            auto const& emission = materials[modelIndex].emission;
+            if (emission[0] <= 0.0f && emission[1] <= 0.0f && emission[2] <= 0.0f) {
+                continue;
+            }
+            _modelTriOffsets[modelIndex] = intCast<std::uint32_t>(_tris.size());
+            auto const modelTransform = modelTransforms[modelIndex].matrix();
+            auto const modelVertexPositions = vertexPositions[vertexRanges[modelIndex]];
+            for (auto const& meshTri : tris[triRanges[modelIndex]]) {
+                Tri const tri{
+                    modelTransform * glm::vec4{modelVertexPositions[meshTri.v1], 1.0f},
+                    modelTransform * glm::vec4{modelVertexPositions[meshTri.v2], 1.0f},
+                    modelTransform * glm::vec4{modelVertexPositions[meshTri.v3], 1.0f}
+                };
+                auto const normal = glm::cross(tri.v2 - tri.v1, tri.v3 - tri.v1);
+                auto const area = glm::length(normal) / 2.0f;
+                // Zero-area tris are kept (and never sampled) so that tri indices map directly.
+                _tris.push_back({tri, area > 0.0f ? normal / (2.0f * area) : normal, emission});
+                _totalArea += area;
+                _cumulativeAreas.push_back(_totalArea);
+            }
+        }
+    }
+
+    bool empty() const {
+        return !(_totalArea > 0.0f);
+    }
+
+    // Samples a point uniformly over the area of all light sources.
+    std::optional<LightSample> sample(FastRNG& randomEngine) const {
+        if (empty()) {
+            return std::nullopt;
+        }
+        auto const target = randomEngine.unitFloatOpen() * _totalArea;
+        auto const triIndex = std::min<std::size_t>(
+            std::upper_bound(_cumulativeAreas.cbegin(), _cumulativeAreas.cend(), target) - _cumulativeAreas.cbegin(),
+            _tris.size() - 1);
+        auto const& lightTri = _tris[triIndex];
+
+        // Uniform sampling of a tri by warping the unit square.
+        auto const sqrtU = std::sqrt(randomEngine.unitFloatOpen());
+        auto const v = randomEngine.unitFloatOpen();
+        auto const coord2 = sqrtU * (1.0f - v);
+        auto const coord3 = sqrtU * v;
+        auto const point = lightTri.tri.v1 + coord2 * (lightTri.tri.v2 - lightTri.tri.v1)
+            + coord3 * (lightTri.tri.v3 - lightTri.tri.v1);
+        return {{point, lightTri.normal, lightTri.emission}};
+    }
+
+    // Probability density (with respect to area) of sampling any given point on a light source.
+    float areaPdf() const {
+        return 1.0f / _totalArea;
+    }
+
+    // Gets the unit normal of a tri of a model, if it's a light source.
+    std::optional<glm::vec3> normal(MeshTriIndex meshTriIndex) const {
+        auto const offset = _modelTriOffsets[meshTriIndex.mesh];
+        if (offset == NOT_EMISSIVE) {
+            return std::nullopt;
+        }
+        return _tris[offset + meshTriIndex.tri].normal;
+    }
+
+private:
+    struct LightTri {
+        Tri tri;                    // In world space.
+        glm::vec3 normal;
+        FastFVec3 emission;
+    };
+
+    constexpr inline static std::uint32_t NOT_EMISSIVE = std::numeric_limits<std::uint32_t>::max();
+
+    std::vector<LightTri> _tris;
+    std::vector<float> _cumulativeAreas;        // Sum of areas of tris up to and including each tri.
+    std::vector<std::uint32_t> _modelTriOffsets;    // Maps from model index to offset of its tris, or NOT_EMISSIVE.
+    float _totalArea;
+};
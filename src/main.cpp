@@ -1,17 +1,23 @@
-#include "bsp.hpp"
 #include "geometry.hpp"
 #include "image.hpp"
 #include "index_types.hpp"
+#include "lights.hpp"
 #include "mesh.hpp"
+#include "mesh_tree.hpp"
+#include "model_tree.hpp"
 #include "render.hpp"
 #include "scene.hpp"
+#include "scene_cache.hpp"
 #include "utility/numeric.hpp"
 #include "utility/permuted_span.hpp"
 #include "utility/span.hpp"
 #include "utility/time.hpp"
+#include "wavefront.hpp"
 
 #include <algorithm>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
 #include <tuple>
@@ -121,10 +127,71 @@ std::tuple<std::vector<glm::vec3>, std::vector<glm::vec3>, std::vector<IndexedTr
 }
 
 
-int main() {
+// Converts a rendered HDR image to a displayable 8-bit image. Modifies the render buffer.
+static void postprocess(Span<glm::vec3> renderBuffer, std::size_t imageWidth, Span<glm::vec3> filteredBuffer,
+        Span<glm::u8vec3> imageBuffer) {
+    std::transform(renderBuffer.begin(), renderBuffer.end(), renderBuffer.begin(),
+        static_cast<glm::vec3(*)(glm::vec3)>(reinhardToneMap));
+    std::transform(renderBuffer.begin(), renderBuffer.end(), renderBuffer.begin(),
+        static_cast<glm::vec3(*)(glm::vec3)>(linearToSRGB));
+    std::transform(renderBuffer.begin(), renderBuffer.end(), renderBuffer.begin(), nanToRed);
+    std::transform(renderBuffer.begin(), renderBuffer.end(), renderBuffer.begin(), infToGreen);
+    std::copy(renderBuffer.begin(), renderBuffer.end(), filteredBuffer.begin());
+    medianFilter<1>(Span<glm::vec3 const>{renderBuffer}, imageWidth, filteredBuffer);
+    std::transform(filteredBuffer.begin(), filteredBuffer.end(), imageBuffer.begin(), floatTo8BitUInt);
+}
+
+
+// Writes an image as a binary PPM file.
+static void writeImage(char const* path, Span<glm::u8vec3 const> image, unsigned width, unsigned height) {
+    std::ofstream output{path, std::ofstream::binary | std::ofstream::out};
+    output << "P6\n";
+    output << width << ' ' << height << '\n';
+    output << "255\n";
+    using PixelType = glm::u8vec3;
+    static_assert(sizeof(PixelType) == 3 && alignof(PixelType) == 1);
+    output.write(reinterpret_cast<char const*>(image.data()), image.size() * sizeof(PixelType));
+}
+
+
+int main(int argc, char** argv) {
+    constexpr char const* SCENE_CACHE_PATH = "scene_cache.bin";
+    constexpr char const* OUTPUT_PATH = "output.ppm";
     constexpr unsigned IMAGE_WIDTH = 1920;
     constexpr unsigned IMAGE_HEIGHT = 1080;
 
+    // Optional argument selects the mesh acceleration structure.
+    auto meshTreeType = MeshTreeType::BSP;
+    if (argc > 1) {
+        if (auto const type = parseMeshTreeType(argv[1])) {
+            meshTreeType = *type;
+        }
+        else {
+            std::cerr << "Unknown acceleration structure \"" << argv[1] << "\", expected one of:";
+            for (auto const& [type, name] : MESH_TREE_TYPE_NAMES) {
+                std::cerr << ' ' << name;
+            }
+            std::cerr << '\n';
+            return 1;
+        }
+    }
+
+    // Optional second argument selects the render engine.
+    auto renderEngine = RenderEngine::MEGAKERNEL;
+    if (argc > 2) {
+        if (auto const engine = parseRenderEngine(argv[2])) {
+            renderEngine = *engine;
+        }
+        else {
+            std::cerr << "Unknown render engine \"" << argv[2] << "\", expected one of:";
+            for (auto const& [engine, name] : RENDER_ENGINE_NAMES) {
+                std::cerr << ' ' << name;
+            }
+            std::cerr << '\n';
+            return 1;
+        }
+    }
+
     std::vector<glm::vec3> renderBuffer{IMAGE_HEIGHT * IMAGE_WIDTH};
     std::vector<glm::vec3> filteredBuffer{IMAGE_HEIGHT * IMAGE_WIDTH};
     std::vector<glm::u8vec3> imageBuffer{IMAGE_HEIGHT * IMAGE_WIDTH};
@@ -153,7 +220,6 @@ int main() {
                 0, 1, 1
             }
         },
-        {}, // Instantiated meshes
         {}  // Preprocessed tris
     };
 
@@ -188,31 +254,51 @@ int main() {
 
     auto const preprocessBeginTime = std::chrono::high_resolution_clock::now();
 
-    scene.preprocessedMaterials.resize(scene.materials.size());
-    std::transform(scene.materials.cbegin(), scene.materials.cend(), scene.preprocessedMaterials.begin(), preprocessMaterial);
-
     auto const pixelToRayTransform = ::pixelToRayTransform(scene.camera.forward(), scene.camera.down(),
         scene.camera.right(), scene.camera.fov, IMAGE_WIDTH, IMAGE_HEIGHT);
 
-    scene.instantiatedMeshes = instantiateMeshes(readOnlySpan(scene.meshes.vertexPositions),
-        readOnlySpan(scene.meshes.vertexNormals), readOnlySpan(scene.meshes.vertexRanges),
-        readOnlySpan(scene.models.meshTransforms), readOnlySpan(scene.models.meshes));
+    auto const sceneHash = hashSceneInputs(scene.meshes, readOnlySpan(scene.materials), meshTreeType);
+    auto preprocessedScene = loadSceneCache(SCENE_CACHE_PATH, sceneHash);
+    if (preprocessedScene) {
+        std::cout << "Loaded scene cache" << '\n';
+    }
+    else {
+        scene.preprocessedMaterials.resize(scene.materials.size());
+        std::transform(scene.materials.cbegin(), scene.materials.cend(), scene.preprocessedMaterials.begin(),
+            preprocessMaterial);
+
+        scene.preprocessedTris = preprocessTris(readOnlySpan(scene.meshes.vertexPositions),
+            readOnlySpan(scene.meshes.vertexRanges), readOnlySpan(scene.meshes.tris),
+            readOnlySpan(scene.meshes.triRanges));
 
-    scene.preprocessedTris = preprocessTris(readOnlySpan(scene.instantiatedMeshes.vertexPositions),
-        readOnlySpan(scene.instantiatedMeshes.vertexRanges), readOnlySpan(scene.meshes.tris),
-        PermutedSpan{readOnlySpan(scene.meshes.triRanges), readOnlySpan(scene.models.meshes)});
+        preprocessedScene = PreprocessedScene{
+            readOnlySpan(scene.preprocessedMaterials),
+            readOnlySpan(scene.preprocessedTris.tris), readOnlySpan(scene.preprocessedTris.triRanges),
+            {}, std::nullopt
+        };
+        preprocessedScene->meshTrees.reserve(scene.meshes.triRanges.size());
+        for (std::size_t meshIndex = 0; meshIndex < scene.meshes.triRanges.size(); ++meshIndex) {
+            preprocessedScene->meshTrees.emplace_back(meshTreeType,
+                readOnlySpan(scene.meshes.vertexPositions)[scene.meshes.vertexRanges[meshIndex]],
+                readOnlySpan(scene.meshes.tris)[scene.meshes.triRanges[meshIndex]],
+                preprocessedScene->tris[preprocessedScene->triRanges[meshIndex]]);
+        }
+
+        if (!saveSceneCache(SCENE_CACHE_PATH, sceneHash, *preprocessedScene)) {
+            std::cout << "Failed to save scene cache" << '\n';
+        }
+    }
 
-    auto meshBoundingBox = computeBoundingBox(readOnlySpan(scene.instantiatedMeshes.vertexPositions));
-    // Expand bounding box slightly to account for FP error when handling surfaces right on edge of box.
-    meshBoundingBox.min *= 1.001f;
-    meshBoundingBox.max *= 1.001f;
+    ModelTree const modelTree{readOnlySpan(preprocessedScene->meshTrees), readOnlySpan(scene.models.meshTransforms),
+        readOnlySpan(scene.models.meshes)};
 
-    BSPTree const bspTree{
-        readOnlySpan(scene.instantiatedMeshes.vertexPositions), readOnlySpan(scene.instantiatedMeshes.vertexRanges),
+    Lights const lights{
+        readOnlySpan(scene.meshes.vertexPositions),
+        PermutedSpan{readOnlySpan(scene.meshes.vertexRanges), readOnlySpan(scene.models.meshes)},
         readOnlySpan(scene.meshes.tris),
         PermutedSpan{readOnlySpan(scene.meshes.triRanges), readOnlySpan(scene.models.meshes)},
-        readOnlySpan(scene.preprocessedTris.tris), readOnlySpan(scene.preprocessedTris.triRanges),
-        meshBoundingBox
+        readOnlySpan(scene.models.meshTransforms),
+        PermutedSpan{preprocessedScene->materials, readOnlySpan(scene.models.materials)}
     };
 
     auto const renderBeginTime = std::chrono::high_resolution_clock::now();
@@ -220,24 +306,43 @@ int main() {
         IMAGE_WIDTH, IMAGE_HEIGHT,
         scene.camera.position, pixelToRayTransform,
         {
-            bspTree,
-            readOnlySpan(scene.instantiatedMeshes.vertexNormals), readOnlySpan(scene.instantiatedMeshes.vertexRanges),
+            modelTree, lights,
+            readOnlySpan(scene.meshes.vertexNormals),
+            PermutedSpan{readOnlySpan(scene.meshes.vertexRanges), readOnlySpan(scene.models.meshes)},
             readOnlySpan(scene.meshes.tris),
             PermutedSpan{readOnlySpan(scene.meshes.triRanges), readOnlySpan(scene.models.meshes)},
-            PermutedSpan{readOnlySpan(scene.preprocessedMaterials), readOnlySpan(scene.models.materials)}
+            PermutedSpan{preprocessedScene->materials, readOnlySpan(scene.models.materials)}
         }
     };
-    render(renderData, Span{renderBuffer});
+    AccumulationBuffer accumulationBuffer{IMAGE_WIDTH, IMAGE_HEIGHT};
+    // Writing previews isn't part of rendering, so is timed separately.
+    FPSeconds previewTime{0.0};
+    // Pixels which converge early leave their share of the sample budget to noisier pixels.
+    std::size_t sampledPixels = IMAGE_WIDTH * IMAGE_HEIGHT;
+    auto remainingSamples = std::uint64_t{PIXEL_SAMPLE_RATE} * sampledPixels;
+    unsigned pass = 0;
+    while (auto const passSamples = passSampleRate(remainingSamples, sampledPixels)) {
+        sampledPixels = renderPass(renderEngine, renderData, accumulationBuffer, passSamples);
+        remainingSamples -= std::uint64_t{passSamples} * sampledPixels;
+        ++pass;
+        // Output intermediate estimates after exponentially spaced passes, so a preview is available early without
+        // much overhead.
+        if (passSampleRate(remainingSamples, sampledPixels) > 0 && (pass & (pass - 1)) == 0) {
+            auto const previewBeginTime = std::chrono::high_resolution_clock::now();
+            accumulationBuffer.estimate(Span{renderBuffer});
+            postprocess(Span{renderBuffer}, IMAGE_WIDTH, Span{filteredBuffer}, Span{imageBuffer});
+            writeImage(OUTPUT_PATH, readOnlySpan(imageBuffer), IMAGE_WIDTH, IMAGE_HEIGHT);
+            previewTime += std::chrono::duration_cast<FPSeconds>(
+                std::chrono::high_resolution_clock::now() - previewBeginTime);
+            std::cout << "Pass " << pass << " done (" << sampledPixels << " pixels sampled, "
+                << static_cast<double>(accumulationBuffer.sampleCount()) / (IMAGE_WIDTH * IMAGE_HEIGHT)
+                << " samples per pixel)" << '\n';
+        }
+    }
+    accumulationBuffer.estimate(Span{renderBuffer});
 
     auto const postprocessBeginTime = std::chrono::high_resolution_clock::now();
-    std::transform(renderBuffer.cbegin(), renderBuffer.cend(), renderBuffer.begin(), reinhardToneMap);
-    std::transform(renderBuffer.cbegin(), renderBuffer.cend(), renderBuffer.begin(),
-        static_cast<glm::vec3(*)(glm::vec3)>(linearToSRGB));
-    std::transform(renderBuffer.cbegin(), renderBuffer.cend(), renderBuffer.begin(), nanToRed);
-    std::transform(renderBuffer.cbegin(), renderBuffer.cend(), renderBuffer.begin(), infToGreen);
-    std::copy(renderBuffer.cbegin(), renderBuffer.cend(), filteredBuffer.begin());
-    medianFilter<1>(readOnlySpan(renderBuffer), IMAGE_WIDTH, Span{filteredBuffer});
-    std::transform(filteredBuffer.cbegin(), filteredBuffer.cend(), imageBuffer.begin(), floatTo8BitUInt);
+    postprocess(Span{renderBuffer}, IMAGE_WIDTH, Span{filteredBuffer}, Span{imageBuffer});
 
     auto const endTime = std::chrono::high_resolution_clock::now();
 
@@ -249,12 +354,18 @@ int main() {
     }
 
     {
-        auto const time = std::chrono::duration_cast<FPSeconds>(postprocessBeginTime - renderBeginTime);
+        auto const time = std::chrono::duration_cast<FPSeconds>(postprocessBeginTime - renderBeginTime) - previewTime;
         auto const timePerPixel = time / (IMAGE_WIDTH * IMAGE_HEIGHT);
-        auto const timePerSample = timePerPixel / PIXEL_SAMPLE_RATE;
+        auto const sampleCount = accumulationBuffer.sampleCount();
+        auto const timePerSample = time / static_cast<double>(sampleCount);
         std::cout << "Render done in " << formatDuration(time)
             << " (" << formatDuration(timePerPixel) << " per pixel, "
-            << formatDuration(timePerSample) << " per sample)" << '\n';
+            << formatDuration(timePerSample) << " per sample, "
+            << static_cast<double>(sampleCount) / (IMAGE_WIDTH * IMAGE_HEIGHT) << " samples per pixel)" << '\n';
+    }
+
+    if (previewTime.count() > 0.0) {
+        std::cout << "Previews done in " << formatDuration(previewTime) << '\n';
     }
 
     {
@@ -269,13 +380,5 @@ int main() {
         std::cout << "Pipeline done in " << formatDuration(time) << '\n';
     }
 
-    {
-        std::ofstream output{"output.ppm", std::ofstream::binary | std::ofstream::out};
-        output << "P6\n";
-        output << IMAGE_WIDTH << ' ' << IMAGE_HEIGHT << '\n';
-        output << "255\n";
-        using PixelType = decltype(imageBuffer)::value_type;
-        static_assert(sizeof(PixelType) == 3 && alignof(PixelType) == 1);
-        output.write(reinterpret_cast<char const*>(imageBuffer.data()), imageBuffer.size() * sizeof(PixelType));
-    }
+    writeImage(OUTPUT_PATH, readOnlySpan(imageBuffer), IMAGE_WIDTH, IMAGE_HEIGHT);
 }
@@ -4,9 +4,7 @@
 #include "index_types.hpp"
 #include "utility/numeric.hpp"
 #include "utility/span.hpp"
-#include "utility/permuted_span.hpp"
 
-#include <algorithm>
 #include <cstddef>
 #include <vector>
 
@@ -76,68 +74,6 @@ inline glm::mat3 normalTransform(glm::mat4 modelTransform) {
 }
 
 
-struct InstantiatedMeshes {
-    std::vector<glm::vec3> vertexPositions;
-    std::vector<glm::vec3> vertexNormals;
-    std::vector<VertexRange> vertexRanges;      // Maps from mesh instance index to range of vertices.
-};
-
-
-// Takes a set of "base" (template) meshes and applies transformations to their vertices, producing a new set of
-// "instantiated" meshes.
-// Produces a new set of vertex positions, vertex normals, and vertex ranges, which specify the instantiated meshes.
-// The tris and tri ranges are unchanged and can be reused from the base meshes.
-inline InstantiatedMeshes instantiateMeshes(Span<glm::vec3 const> vertexPositions, Span<glm::vec3 const> vertexNormals,
-        Span<VertexRange const> vertexRanges, Span<MeshTransform const> instanceTransforms,
-        Span<MeshIndex const> instanceMeshes) {
-    assert(vertexPositions.size() == vertexNormals.size());
-    assert(instanceTransforms.size() == instanceMeshes.size());
-
-    auto const instanceCount = instanceTransforms.size();
-    PermutedSpan const instanceVertexRanges{vertexRanges, instanceMeshes};
-
-    InstantiatedMeshes result;
-
-    {
-        std::size_t vertexCount = 0;
-        for (auto const& range : instanceVertexRanges) {
-            vertexCount += range.size;
-        }
-        result.vertexPositions.resize(vertexCount);
-        result.vertexNormals.resize(vertexCount);
-    }
-    result.vertexRanges.resize(instanceCount);
-
-    std::size_t verticesOffset = 0;
-    for (std::size_t instanceIndex = 0; instanceIndex < instanceCount; ++instanceIndex) {
-        auto const modelTransform = instanceTransforms[instanceIndex].matrix();
-        auto const& vertexRange = instanceVertexRanges[instanceIndex];
-        {
-            auto const meshVertexPositions = vertexPositions[vertexRange];
-            std::transform(meshVertexPositions.begin(), meshVertexPositions.end(), result.vertexPositions.begin() + verticesOffset,
-                [&modelTransform](auto const& position) {
-                    return modelTransform * glm::vec4{position, 1.0f};
-                });
-        }
-        {
-            auto const normalTransform = ::normalTransform(modelTransform);
-            auto const meshVertexNormals = vertexNormals[vertexRange];
-            std::transform(meshVertexNormals.begin(), meshVertexNormals.end(), result.vertexNormals.begin() + verticesOffset,
-                    [&normalTransform](auto const& normal) {
-                    return glm::normalize(normalTransform * normal);
-                });
-        }
-        result.vertexRanges[instanceIndex] = {
-            intCast<VertexRange::IndexType>(verticesOffset),
-            intCast<VertexRange::SizeType>(vertexRange.size)
-        };
-        verticesOffset += vertexRange.size;
-    }
-
-    return result;
-}
-
-
 struct PreprocessedTris {
     std::vector<PreprocessedTri> tris;
     std::vector<TriRange> triRanges;        // Maps from mesh index to range of preprocessed tris.
@@ -147,41 +83,41 @@ struct PreprocessedTris {
 // Preprocesses the tris of a set of meshes.
 // Produces a new set of tri ranges mapping from mesh index to range of preprocessed tris.
 inline PreprocessedTris preprocessTris(Span<glm::vec3 const> vertexPositions, Span<VertexRange const> vertexRanges,
-        Span<IndexedTri const> tris, PermutedSpan<TriRange const, MeshIndex> triRanges) {
+        Span<IndexedTri const> tris, Span<TriRange const> triRanges) {
     assert(vertexRanges.size() == triRanges.size());
 
-    auto const instanceCount = vertexRanges.size();
+    auto const meshCount = vertexRanges.size();
 
     PreprocessedTris result;
 
     {
         std::size_t triCount = 0;
-        for (std::size_t instanceIndex = 0; instanceIndex < instanceCount; ++instanceIndex) {
-            triCount += triRanges[instanceIndex].size;
+        for (std::size_t meshIndex = 0; meshIndex < meshCount; ++meshIndex) {
+            triCount += triRanges[meshIndex].size;
         }
         result.tris.resize(triCount);
     }
-    result.triRanges.resize(instanceCount);
+    result.triRanges.resize(meshCount);
     
     std::size_t trisOffset = 0;
-    for (std::size_t instanceIndex = 0; instanceIndex < instanceCount; ++instanceIndex) {
-        auto const instanceVertexPositions = vertexPositions[vertexRanges[instanceIndex]];
-        auto const instanceTris = tris[triRanges[instanceIndex]];
-        for (std::size_t i = 0; i < instanceTris.size(); ++i) {
-            auto const& meshTri = instanceTris[i];
+    for (std::size_t meshIndex = 0; meshIndex < meshCount; ++meshIndex) {
+        auto const meshVertexPositions = vertexPositions[vertexRanges[meshIndex]];
+        auto const meshTris = tris[triRanges[meshIndex]];
+        for (std::size_t i = 0; i < meshTris.size(); ++i) {
+            auto const& meshTri = meshTris[i];
             Tri const tri{
-                instanceVertexPositions[meshTri.v1],
-                instanceVertexPositions[meshTri.v2],
-                instanceVertexPositions[meshTri.v3]
+                meshVertexPositions[meshTri.v1],
+                meshVertexPositions[meshTri.v2],
+                meshVertexPositions[meshTri.v3]
             };
             auto const preprocessedTri = preprocessTri(tri);
             result.tris[trisOffset + i] = preprocessedTri;
         }
-        result.triRanges[instanceIndex] = {
+        result.triRanges[meshIndex] = {
             intCast<TriRange::IndexType>(trisOffset),
-            intCast<TriRange::SizeType>(instanceTris.size())
+            intCast<TriRange::SizeType>(meshTris.size())
         };
-        trisOffset += instanceTris.size();
+        trisOffset += meshTris.size();
     }
 
     return result;
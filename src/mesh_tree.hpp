@@ -0,0 +1,152 @@
+#pragma once
+
+#include "bsp.hpp"
+#include "bvh2.hpp"
+#include "bvh8.hpp"
+#include "geometry.hpp"
+#include "leaf_tris.hpp"
+#include "mesh.hpp"
+#include "utility/binary_cache.hpp"
+#include "utility/span.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include <glm/vec3.hpp>
+
+
+// Available acceleration structures for line-mesh intersections.
+enum class MeshTreeType : std::uint8_t {
+    BSP,
+    BVH2,
+    SBVH,       // BVH2 with spatial splits.
+    LBVH,       // BVH2 built from Morton codes.
+    BVH8
+};
+
+
+constexpr inline std::array<std::pair<MeshTreeType, char const*>, 5> MESH_TREE_TYPE_NAMES{{
+    {MeshTreeType::BSP, "bsp"},
+    {MeshTreeType::BVH2, "bvh2"},
+    {MeshTreeType::SBVH, "sbvh"},
+    {MeshTreeType::LBVH, "lbvh"},
+    {MeshTreeType::BVH8, "bvh8"}
+}};
+
+
+inline std::optional<MeshTreeType> parseMeshTreeType(char const* name) {
+    for (auto const& [type, typeName] : MESH_TREE_TYPE_NAMES) {
+        if (std::strcmp(name, typeName) == 0) {
+            return type;
+        }
+    }
+    return std::nullopt;
+}
+
+
+// Acceleration structure for line-mesh intersections, for a single mesh. The structure used is chosen at runtime.
+class MeshTree {
+public:
+    MeshTree(MeshTreeType type, Span<glm::vec3 const> vertexPositions, Span<IndexedTri const> tris,
+            Span<PreprocessedTri const> preprocessedTris) :
+        _type{type}, _tree{_build(type, vertexPositions, tris, preprocessedTris)}
+    {}
+
+    // Creates a tree viewing data written by write(), which must outlive the tree.
+    static std::optional<MeshTree> read(CacheReader& reader) {
+        auto const type = reader.read<MeshTreeType>();
+        switch (type) {
+        case MeshTreeType::BSP:
+            return MeshTree{type, BSPTree::read(reader)};
+        case MeshTreeType::BVH2:
+        case MeshTreeType::SBVH:
+        case MeshTreeType::LBVH:
+            return MeshTree{type, BVH2::read(reader)};
+        case MeshTreeType::BVH8:
+            return MeshTree{type, BVH8::read(reader)};
+        default:
+            return std::nullopt;
+        }
+    }
+
+    void write(CacheWriter& writer) const {
+        writer.write(type());
+        std::visit([&writer](auto const& tree) { tree.write(writer); }, _tree);
+    }
+
+    MeshTreeType type() const {
+        return _type;
+    }
+
+    BoundingBox const& box() const {
+        return std::visit([](auto const& tree) -> BoundingBox const& { return tree.box(); }, _tree);
+    }
+
+    // Finds the nearest intersection with line parameter in [tMin, tMax].
+    template<SurfaceConsideration Surfaces>
+    std::optional<LineTriIntersection> lineTriNearestIntersection(Line const& line, float tMin, float tMax) const {
+        return std::visit([&line, tMin, tMax](auto const& tree) {
+            return tree.template lineTriNearestIntersection<Surfaces>(line, tMin, tMax);
+        }, _tree);
+    }
+
+    // Finds the nearest intersection of each line of a packet, with line parameter in [tMin, tMaxs[i]] for line i.
+    // The BSP tree traverses the lines together, the other structures trace them one at a time.
+    template<SurfaceConsideration Surfaces>
+    std::array<std::optional<LineTriIntersection>, LINE_PACKET_SIZE> lineTriNearestIntersections(
+            LinePacket const& lines, float tMin, FVec8 tMaxs) const {
+        return std::visit([&lines, tMin, tMaxs](auto const& tree) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(tree)>, BSPTree>) {
+                return tree.template lineTriNearestIntersections<Surfaces>(lines, tMin, tMaxs);
+            }
+            else {
+                std::array<std::optional<LineTriIntersection>, LINE_PACKET_SIZE> intersections;
+                for (unsigned i = 0; i < LINE_PACKET_SIZE; ++i) {
+                    intersections[i] = tree.template lineTriNearestIntersection<Surfaces>(lines.line(i), tMin,
+                        tMaxs[i]);
+                }
+                return intersections;
+            }
+        }, _tree);
+    }
+
+    // Checks if a line intersects any tri with line parameter in [tMin, tMax].
+    template<SurfaceConsideration Surfaces>
+    bool occluded(Line const& line, float tMin, float tMax) const {
+        return std::visit([&line, tMin, tMax](auto const& tree) {
+            return tree.template occluded<Surfaces>(line, tMin, tMax);
+        }, _tree);
+    }
+
+private:
+    using Tree = std::variant<BSPTree, BVH2, BVH8>;
+
+    MeshTreeType _type;
+    Tree _tree;
+
+    MeshTree(MeshTreeType type, Tree tree) :
+        _type{type}, _tree{std::move(tree)}
+    {}
+
+    static Tree _build(MeshTreeType type, Span<glm::vec3 const> vertexPositions, Span<IndexedTri const> tris,
+            Span<PreprocessedTri const> preprocessedTris) {
+        switch (type) {
+        case MeshTreeType::BVH2:
+            return Tree{std::in_place_type<BVH2>, vertexPositions, tris, preprocessedTris};
+        case MeshTreeType::SBVH:
+            return Tree{std::in_place_type<BVH2>, vertexPositions, tris, preprocessedTris, SBVH_DUPLICATION_BUDGET};
+        case MeshTreeType::LBVH:
+            return Tree{std::in_place_type<BVH2>, BVH2::linear(vertexPositions, tris, preprocessedTris)};
+        case MeshTreeType::BVH8:
+            return Tree{std::in_place_type<BVH8>, vertexPositions, tris, preprocessedTris};
+        case MeshTreeType::BSP:
+        default:
+            return Tree{std::in_place_type<BSPTree>, vertexPositions, tris, preprocessedTris};
+        }
+    }
+};
@@ -0,0 +1,316 @@
+#pragma once
+
+#include "geometry.hpp"
+#include "index_types.hpp"
+#include "mesh.hpp"
+#include "mesh_tree.hpp"
+#include "utility/numeric.hpp"
+#include "utility/span.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include <glm/common.hpp>
+#include <glm/gtc/matrix_inverse.hpp>
+#include <glm/mat3x3.hpp>
+#include <glm/mat4x3.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+
+// Represents an intersection of a line and model.
+struct LineMeshIntersection {
+    float t;                    // Line equation parameter.
+    float pointCoord2;          // Barycentric coordinate relative to vertex 2.
+    float pointCoord3;          // Barycentric coordinate relative to vertex 3.
+    glm::vec3 point;            // Intersection point.
+    MeshTriIndex meshTriIndex;  // Index of intersected model + tri of its base mesh.
+};
+
+
+// Two-level structure for line-mesh intersections over a set of models (mesh instances).
+// Models are organised into a bounding volume hierarchy. Each model references the tree of its base mesh, which is
+// traversed in the model's object space, so base mesh data is shared between all its models rather than duplicated.
+class ModelTree {
+public:
+    ModelTree(Span<MeshTree const> meshTrees, Span<MeshTransform const> modelTransforms,
+            Span<MeshIndex const> modelMeshes) :
+        _meshTrees{meshTrees}, _models{}, _modelOrder{}, _nodes{}
+    {
+        assert(modelTransforms.size() == modelMeshes.size());
+
+        auto const modelCount = intCast<MeshIndex>(modelTransforms.size());
+        _models.reserve(modelCount);
+        _modelOrder.reserve(modelCount);
+        for (MeshIndex modelIndex = 0; modelIndex < modelCount; ++modelIndex) {
+            auto const meshIndex = modelMeshes[modelIndex];
+            auto const modelTransform = modelTransforms[modelIndex].matrix();
+            glm::mat4x3 const worldToObject{glm::inverse(glm::mat4{modelTransform})};
+            auto const box = transformBoundingBox(_meshTrees[meshIndex].box(), modelTransform);
+            _models.push_back({worldToObject, ::normalTransform(modelTransform), box, meshIndex});
+            _modelOrder.push_back(modelIndex);
+        }
+
+        if (modelCount > 0) {
+            _nodes.reserve(2 * ((modelCount + Node::MAX_MODELS - 1) / Node::MAX_MODELS));
+            _createNode(Span{_modelOrder});
+        }
+    }
+
+    // Transformation of a model's vertex normals from object space to world space.
+    glm::mat3 const& normalTransform(MeshIndex model) const {
+        return _models[model].normalTransform;
+    }
+
+    // Models are visited front to back, and each model's mesh tree is only searched up to the nearest intersection
+    // found so far.
+    template<SurfaceConsideration Surfaces>
+    std::optional<LineMeshIntersection> lineTriNearestIntersection(Line const& line, float tMin) const {
+        if (_nodes.empty()) {
+            return std::nullopt;
+        }
+        auto const preprocessedLine = preprocessLine(line);
+        auto const rootInterval = lineBoxIntersection(preprocessedLine, _nodes[0].box, tMin, INFINITY);
+        if (rootInterval.empty()) {
+            return std::nullopt;
+        }
+
+        std::optional<LineMeshIntersection> nearestIntersection;
+        std::array<StackEntry, STACK_SIZE> stack;
+        std::size_t stackSize = 0;
+        stack[stackSize++] = {0, rootInterval.entry};
+        while (stackSize > 0) {
+            auto const entry = stack[--stackSize];
+            if (nearestIntersection && entry.tEntry > nearestIntersection->t) {
+                continue;
+            }
+            auto const& node = _nodes[entry.index];
+            if (node.modelCount > 0) {
+                for (std::uint32_t i = node.index; i < node.index + node.modelCount; ++i) {
+                    auto const modelIndex = _modelOrder[i];
+                    auto const& model = _models[modelIndex];
+                    auto const tMax = nearestIntersection ? nearestIntersection->t : INFINITY;
+                    auto const intersection = _meshTrees[model.mesh].lineTriNearestIntersection<Surfaces>(
+                        _objectLine(model, line), tMin, tMax);
+                    if (intersection && (!nearestIntersection || intersection->t < nearestIntersection->t)) {
+                        nearestIntersection = {
+                            intersection->t, intersection->pointCoord2, intersection->pointCoord3,
+                            line(intersection->t), {modelIndex, intersection->tri}
+                        };
+                    }
+                }
+                continue;
+            }
+
+            auto const tMax = nearestIntersection ? nearestIntersection->t : INFINITY;
+            auto const negativeChild = entry.index + 1;
+            auto const positiveChild = node.index;
+            auto const negative = lineBoxIntersection(preprocessedLine, _nodes[negativeChild].box, tMin, tMax);
+            auto const positive = lineBoxIntersection(preprocessedLine, _nodes[positiveChild].box, tMin, tMax);
+            // Push the far child first, so the near child is visited first.
+            StackEntry const negativeEntry{negativeChild, negative.entry};
+            StackEntry const positiveEntry{positiveChild, positive.entry};
+            auto const negativeNearer = negative.entry <= positive.entry;
+            if (!positive.empty() && negativeNearer) {
+                stack[stackSize++] = positiveEntry;
+            }
+            if (!negative.empty()) {
+                stack[stackSize++] = negativeEntry;
+            }
+            if (!positive.empty() && !negativeNearer) {
+                stack[stackSize++] = positiveEntry;
+            }
+            assert(stackSize <= stack.size());
+        }
+        return nearestIntersection;
+    }
+
+    // Finds the nearest intersection of each line of a packet, traversing the lines together.
+    template<SurfaceConsideration Surfaces>
+    std::array<std::optional<LineMeshIntersection>, LINE_PACKET_SIZE> lineTriNearestIntersections(
+            LinePacket const& lines, float tMin) const {
+        std::array<std::optional<LineMeshIntersection>, LINE_PACKET_SIZE> nearestIntersections;
+        if (_nodes.empty()) {
+            return nearestIntersections;
+        }
+
+        auto const preprocessedLines = preprocessLinePacket(lines);
+        FVec8 nearestTs{INFINITY};      // Infinite for lines with no intersection found.
+        std::array<std::uint32_t, STACK_SIZE> stack;
+        std::size_t stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0) {
+            auto const nodeIndex = stack[--stackSize];
+            auto const& node = _nodes[nodeIndex];
+            // Tested when popped rather than pushed, as the nearest intersections may have moved closer since.
+            if (linePacketBoxIntersection(preprocessedLines, node.box, FVec8{tMin}, nearestTs).nonEmpty() == 0) {
+                continue;
+            }
+            if (node.modelCount > 0) {
+                for (std::uint32_t i = node.index; i < node.index + node.modelCount; ++i) {
+                    auto const modelIndex = _modelOrder[i];
+                    auto const& model = _models[modelIndex];
+                    LinePacket const objectLines{
+                        model.worldToObject * glm::vec4{lines.origin, 1.0f},
+                        transformDirections(lines.directions, model.worldToObject)
+                    };
+                    auto const intersections =
+                        _meshTrees[model.mesh].lineTriNearestIntersections<Surfaces>(objectLines, tMin, nearestTs);
+                    for (unsigned j = 0; j < LINE_PACKET_SIZE; ++j) {
+                        auto const& intersection = intersections[j];
+                        if (intersection && intersection->t < nearestTs[j]) {
+                            nearestTs[j] = intersection->t;
+                            nearestIntersections[j] = {
+                                intersection->t, intersection->pointCoord2, intersection->pointCoord3,
+                                lines.line(j)(intersection->t), {modelIndex, intersection->tri}
+                            };
+                        }
+                    }
+                }
+                continue;
+            }
+
+            // The lines are assumed to have similar directions, so the first line chooses the child order. The child
+            // on the side the line is heading from is pushed last, so it's visited first.
+            auto const negativeChild = nodeIndex + 1;
+            auto const positiveChild = node.index;
+            auto const negativeNearer = lines.directions.extract(0)[node.divisionAxis] >= 0.0f;
+            stack[stackSize++] = negativeNearer ? positiveChild : negativeChild;
+            stack[stackSize++] = negativeNearer ? negativeChild : positiveChild;
+            assert(stackSize <= stack.size());
+        }
+        return nearestIntersections;
+    }
+
+    // Checks if a line intersects any tri with line parameter in [tMin, tMax].
+    // Faster than finding the nearest intersection, as traversal stops at the first intersection found.
+    template<SurfaceConsideration Surfaces>
+    bool occluded(Line const& line, float tMin, float tMax) const {
+        if (_nodes.empty()) {
+            return false;
+        }
+        auto const preprocessedLine = preprocessLine(line);
+        if (lineBoxIntersection(preprocessedLine, _nodes[0].box, tMin, tMax).empty()) {
+            return false;
+        }
+
+        std::array<std::uint32_t, STACK_SIZE> stack;
+        std::size_t stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0) {
+            auto const nodeIndex = stack[--stackSize];
+            auto const& node = _nodes[nodeIndex];
+            if (node.modelCount > 0) {
+                for (std::uint32_t i = node.index; i < node.index + node.modelCount; ++i) {
+                    auto const& model = _models[_modelOrder[i]];
+                    if (_meshTrees[model.mesh].occluded<Surfaces>(_objectLine(model, line), tMin, tMax)) {
+                        return true;
+                    }
+                }
+                continue;
+            }
+
+            // Any intersection will do, so the order of the children doesn't matter.
+            for (auto const child : {nodeIndex + 1, node.index}) {
+                if (!lineBoxIntersection(preprocessedLine, _nodes[child].box, tMin, tMax).empty()) {
+                    stack[stackSize++] = child;
+                }
+            }
+            assert(stackSize <= stack.size());
+        }
+        return false;
+    }
+
+private:
+    struct Model {
+        glm::mat4x3 worldToObject;      // Inverse of the model transform.
+        glm::mat3 normalTransform;
+        BoundingBox box;                // In world space.
+        MeshIndex mesh;                 // Base mesh index.
+    };
+
+    struct Node {
+        constexpr inline static std::uint8_t MAX_MODELS = 2;
+
+        BoundingBox box;
+        std::uint32_t index;            // modelCount = 0: inode, negative child is the next node,
+                                        //                 positive child at index
+                                        // modelCount > 0: leaf, models at index in model order
+        std::uint8_t modelCount;
+        std::uint8_t divisionAxis;      // 0 (X), 1 (Y), 2 (Z)
+    };
+
+    struct StackEntry {
+        std::uint32_t index;            // Node index.
+        float tEntry;                   // Line parameter at which the line enters the node box.
+    };
+
+    // Models are split at the median until there are at most Node::MAX_MODELS per leaf, which bounds the tree depth.
+    constexpr inline static unsigned MAX_DEPTH = ceilLog2(
+        (std::uint64_t{std::numeric_limits<MeshIndex>::max()} + Node::MAX_MODELS - 1) / Node::MAX_MODELS);
+    // Each inode visited pushes at most 2 entries and pops 1.
+    constexpr inline static std::size_t STACK_SIZE = MAX_DEPTH + 1;
+
+    Span<MeshTree const> _meshTrees;    // Maps from base mesh index to the mesh's tree.
+    std::vector<Model> _models;
+    std::vector<MeshIndex> _modelOrder; // Model indices, ordered such that each leaf's models are contiguous.
+    std::vector<Node> _nodes;           // Stored in depth-first order.
+
+    // Line in a model's object space. Direction isn't normalised, so that the line parameter is the same in object
+    // space and world space.
+    static Line _objectLine(Model const& model, Line const& line) {
+        return {
+            model.worldToObject * glm::vec4{line.origin, 1.0f},
+            model.worldToObject * glm::vec4{line.direction, 0.0f}
+        };
+    }
+
+    // Creates the node for a set of models, with its descendants following it. Splits the models at the median of
+    // their centres along the axis with the greatest spread.
+    void _createNode(Span<MeshIndex> models) {
+        BoundingBox box{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+        BoundingBox centreBox = box;
+        for (auto const& modelIndex : models) {
+            auto const& modelBox = _models[modelIndex].box;
+            box.min = glm::min(box.min, modelBox.min);
+            box.max = glm::max(box.max, modelBox.max);
+            auto const centre = (modelBox.min + modelBox.max) / 2.0f;
+            centreBox.min = glm::min(centreBox.min, centre);
+            centreBox.max = glm::max(centreBox.max, centre);
+        }
+
+        if (models.size() <= Node::MAX_MODELS) {
+            auto const index = intCast<std::uint32_t>(models.data() - _modelOrder.data());
+            _nodes.push_back({box, index, intCast<std::uint8_t>(models.size()), 0});
+            return;
+        }
+
+        auto const centreExtent = centreBox.max - centreBox.min;
+        std::uint8_t axis = 0;
+        if (centreExtent.y > centreExtent[axis]) {
+            axis = 1;
+        }
+        if (centreExtent.z > centreExtent[axis]) {
+            axis = 2;
+        }
+        auto const middle = models.begin() + models.size() / 2;
+        std::nth_element(models.begin(), middle, models.end(), [this, axis](MeshIndex model1, MeshIndex model2) {
+            auto const& box1 = _models[model1].box;
+            auto const& box2 = _models[model2].box;
+            return box1.min[axis] + box1.max[axis] < box2.min[axis] + box2.max[axis];
+        });
+
+        auto const index = _nodes.size();
+        _nodes.push_back({box, 0, 0, axis});
+        _createNode(Span{models.begin(), models.size() / 2});
+        _nodes[index].index = intCast<std::uint32_t>(_nodes.size());
+        _createNode(Span{middle, models.size() - models.size() / 2});
+    }
+};
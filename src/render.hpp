@@ -1,23 +1,28 @@
 #pragma once
 
-#include "bsp.hpp"
+#include "image.hpp"
 #include "index_types.hpp"
+#include "lights.hpp"
 #include "material.hpp"
 #include "mesh.hpp"
-#include "utility/index_iterator.hpp"
+#include "model_tree.hpp"
 #include "utility/math.hpp"
 #include "utility/numeric.hpp"
 #include "utility/permuted_span.hpp"
 #include "utility/random.hpp"
 #include "utility/span.hpp"
+#include "utility/tile_scheduler.hpp"
 #include "utility/vectorised.hpp"
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cmath>
 #include <cstddef>
-#include <execution>
+#include <cstdint>
+#include <optional>
+#include <vector>
 
 #include <glm/geometric.hpp>
 #include <glm/gtc/constants.hpp>
@@ -26,10 +31,11 @@
 
 
 struct RayTraceData {
-    BSPTree const& bspTree;
-    Span<glm::vec3 const> vertexNormals;                // Vertex normals for instantiated meshes.
-    Span<VertexRange const> vertexRanges;               // Maps from model index to range of vertices.
-    Span<IndexedTri const> tris;                        // Tris for base meshes (not instantiated meshes).
+    ModelTree const& modelTree;
+    Lights const& lights;
+    Span<glm::vec3 const> vertexNormals;                // Vertex normals for base meshes.
+    PermutedSpan<VertexRange const, MeshIndex> vertexRanges;   // Maps from model index to range of vertices.
+    Span<IndexedTri const> tris;                        // Tris for base meshes.
     PermutedSpan<TriRange const, MeshIndex> triRanges;  // Maps from model index to range of tris.
     PermutedSpan<PreprocessedMaterial const, MeshIndex> materials;  // Maps from model index to preprocessed mesh material.
 };
@@ -44,44 +50,76 @@ struct RenderData {
 };
 
 
-constexpr inline static unsigned PIXEL_SAMPLE_RATE = 2048;      // Number of ray samples per pixel.
+// Average number of ray samples per pixel. Samples not needed by pixels which converge early go to noisier pixels.
+constexpr inline static unsigned PIXEL_SAMPLE_RATE = 2048;
 constexpr inline static float RAY_INTERSECTION_T_MIN = 1e-3f;   // Intersections with line param < this are discarded.
 constexpr unsigned RAY_BOUNCE_LIMIT = 8;        // Depth to which rays are explored. Must be <= 8
+constexpr inline static unsigned PASS_SAMPLE_RATE = 64;         // Number of ray samples per pixel per progressive pass.
+// Pixels stop being sampled once their estimated error (see AccumulationBuffer::error()) is below this.
+constexpr inline static float PIXEL_ERROR_THRESHOLD = 1.0f / 255.0f;    // 1 level of 8-bit output.
+// Minimum number of ray samples before a pixel may stop being sampled. Rare light paths (e.g. caustics, small lights)
+// may be missed by all of a pixel's first samples, giving an error estimate of 0, so this must be more than 1 pass.
+constexpr inline static unsigned PIXEL_MIN_SAMPLE_RATE = 2 * PASS_SAMPLE_RATE;
+constexpr inline static unsigned PIXEL_MAX_SAMPLE_RATE = 4 * PIXEL_SAMPLE_RATE;  // Maximum ray samples for one pixel.
+constexpr inline static unsigned RENDER_TILE_SIZE = 16;         // Width and height of tiles rendered by each thread.
+
+
+// Lighting model based on this paper:
+// B. Walter, S. R. Marschner, H. Li, and K. E. Torrance, "Microfacet models for refraction through rough surfaces", 2007.
+// The lighting functions work on single values or on FVec8s of values.
+
+// GGX microfacet distribution function.
+template<typename T>
+T ggxNDF(T alphaSq, T nDotH) {
+    // assert(nDotH > 0.0f);
+    auto const nDotHSq = square(nDotH);
+    auto const tanThetaSq = 1.0f / nDotHSq - 1.0f;
+    return alphaSq / (glm::pi<float>() * square(nDotHSq) * square(alphaSq + tanThetaSq));
+}
 
 
-// Performs backwards path tracing on a scene for a single ray.
-inline FastFVec3 rayTrace(RayTraceData const& data, Line ray, FastRNG& randomEngine) {
-    // Lighting model based on this paper:
-    // B. Walter, S. R. Marschner, H. Li, and K. E. Torrance, "Microfacet models for refraction through rough surfaces", 2007.
-
-    // GGX microfacet distribution function.
-    auto const ndf = [](FVec8 alphaSq, FVec8 nDotH) {
-        // assert(nDotH > 0.0f);
-        auto const nDotHSq = square(nDotH);
-        auto const tanThetaSq = 1.0f / nDotHSq - 1.0f;
-        return alphaSq / (glm::pi<float>() * square(nDotHSq) * square(alphaSq + tanThetaSq));
+// GGX geometry function + Smith's method.
+template<typename T>
+T ggxGeometry(T alphaSq, T nDotI, T nDotO, T hDotI, T hDotO) {
+    using std::sqrt;
+    auto const partial = [alphaSq](T nDotR) {
+        auto const nDotRSq = square(nDotR);
+        return 1.0f + sqrt(1.0f + alphaSq / nDotRSq - alphaSq);
     };
 
-    // GGX geometry function + Smith's method.
-    auto const geometry = [](FVec8 alphaSq, FVec8 nDotI, FVec8 nDotO, FVec8 hDotI, FVec8 hDotO) {
-        auto const partial = [alphaSq](FVec8 nDotR) {
-            auto const nDotRSq = square(nDotR);
-            return 1.0f + sqrt(1.0f + alphaSq / nDotRSq - alphaSq);
-        };
+    // assert(nDotI > 0.0f && nDotO > 0.0f && hDotI > 0.0f && hDotO == hDotI);
+    return 4.0f / (partial(nDotI) * partial(nDotO));
+}
 
-        // assert(nDotI > 0.0f && nDotO > 0.0f && hDotI > 0.0f && hDotO == hDotI);
-        return 4.0f / (partial(nDotI) * partial(nDotO));
-    };
 
-    // Fresnel-Schlick equation.
-    auto const fresnel = [](FVec3_8 f0, FVec8 hDotO) {
-        // assert(hDotO >= 0.0f);
-        // Sometimes hDotO is very slightly > 1 due to FP error, which technically invalidates this formula.
-        // But this error becomes extremely small when raised to the 5th power, so it doesn't have much effect.
-        auto const tmp = FVec3_8{iPow(1.0f - hDotO, 5)};
-        return fnma(f0, tmp, f0 + tmp);
-    };
+// Fresnel-Schlick equation. Colours are glm::vec3 for single values, or FVec3_8 for FVec8s of values.
+template<typename Colour, typename T>
+Colour fresnelSchlick(Colour f0, T hDotO) {
+    // assert(hDotO >= 0.0f);
+    // Sometimes hDotO is very slightly > 1 due to FP error, which technically invalidates this formula.
+    // But this error becomes extremely small when raised to the 5th power, so it doesn't have much effect.
+    auto const tmp = Colour{iPow(1.0f - hDotO, 5)};
+    return fnma(f0, tmp, f0 + tmp);
+}
 
+
+// Computes the unit normal of a model at an intersection point, interpolated from the vertex normals of the tri.
+inline glm::vec3 intersectionNormal(RayTraceData const& data, LineMeshIntersection const& intersection) {
+    auto const& vertexRange = data.vertexRanges[intersection.meshTriIndex.mesh];
+    auto const vertexNormals = data.vertexNormals[vertexRange];
+    auto const& triRange = data.triRanges[intersection.meshTriIndex.mesh];
+    auto const& tri = data.tris[triRange][intersection.meshTriIndex.tri];
+    auto const pointCoord1 = 1.0f - intersection.pointCoord2 - intersection.pointCoord3;
+    auto const objectNormal = vertexNormals[tri.v1] * pointCoord1 + vertexNormals[tri.v2] * intersection.pointCoord2
+        + vertexNormals[tri.v3] * intersection.pointCoord3;
+    return glm::normalize(data.modelTree.normalTransform(intersection.meshTriIndex.mesh) * objectNormal);
+}
+
+
+// Performs backwards path tracing on a scene for a single ray, given the ray's nearest intersection (which may be
+// found for several rays together).
+inline FastFVec3 rayTrace(RayTraceData const& data, Line ray,
+        std::optional<LineMeshIntersection> const& rayIntersection, FastRNG& randomEngine) {
     // TODO? allow for >8 bounces
     static_assert(RAY_BOUNCE_LIMIT <= 8);
 
@@ -89,20 +127,30 @@ inline FastFVec3 rayTrace(RayTraceData const& data, Line ray, FastRNG& randomEng
 
     // We first iteratively trace the path to the endpoint (slow) while collecting material data, then calculate
     // lighting all at once in parallel (fast).
+    // Light is gathered in two ways, combined with multiple importance sampling (power heuristic):
+    //   - Paths which happen to hit an emissive surface after sampling the BRDF.
+    //   - Next event estimation: at each bounce, a point on a light source is sampled and connected via a shadow ray.
 
     FVec8 ndfAlphaSqs{};
     FVec8 geometryAlphaSqs{};
     FVec3_8 f0s{};
     FVec3_8 adjustedColours{};
     std::array<FastFVec3, RAY_DEPTH_LIMIT> emissions;
+    std::array<float, RAY_DEPTH_LIMIT> emissionLightPdfs{};     // Solid angle density of sampling via the lights.
     FVec8 nDotOs{};
     FVec8 nDotIs{};
     FVec8 nDotHs{};
     FVec8 hDotOs{};
+    // Next event estimation samples. Light pdf of 0 indicates no contribution.
+    FVec3_8 lightEmissions{};
+    FVec8 lightPdfs{};          // Solid angle density.
+    FVec8 lightNDotIs{};
+    FVec8 lightNDotHs{};
+    FVec8 lightHDotOs{};
     unsigned depth = 0;
     while (true) {
-        auto const intersection = data.bspTree.lineTriNearestIntersection<SurfaceConsideration::FRONT_ONLY>(
-            ray, RAY_INTERSECTION_T_MIN);
+        auto const intersection = depth == 0 ? rayIntersection
+            : data.modelTree.lineTriNearestIntersection<SurfaceConsideration::FRONT_ONLY>(ray, RAY_INTERSECTION_T_MIN);
         if (!intersection) {
             break;
         }
@@ -111,6 +159,12 @@ inline FastFVec3 rayTrace(RayTraceData const& data, Line ray, FastRNG& randomEng
 
         auto const& material = data.materials[intersection->meshTriIndex.mesh];
         emissions[bounce] = material.emission;
+        if (bounce > 0) {
+            if (auto const lightNormal = data.lights.normal(intersection->meshTriIndex)) {
+                auto const lightCos = -glm::dot(*lightNormal, ray.direction);
+                emissionLightPdfs[bounce] = data.lights.areaPdf() * square(intersection->t) / lightCos;
+            }
+        }
 
         ++depth;
 
@@ -118,15 +172,7 @@ inline FastFVec3 rayTrace(RayTraceData const& data, Line ray, FastRNG& randomEng
             break;
         }
 
-        auto const& vertexRange = data.vertexRanges[intersection->meshTriIndex.mesh];
-        auto const vertexNormals = data.vertexNormals[vertexRange];
-        auto const& triRange = data.triRanges[intersection->meshTriIndex.mesh];
-        auto const& tri = data.tris[triRange][intersection->meshTriIndex.tri];
-        auto const& pointCoord2 = intersection->pointCoord2;
-        auto const& pointCoord3 = intersection->pointCoord3;
-        auto const pointCoord1 = 1.0f - pointCoord2 - pointCoord3;
-        auto normal = vertexNormals[tri.v1] * pointCoord1 + vertexNormals[tri.v2] * pointCoord2
-            + vertexNormals[tri.v3] * pointCoord3;
+        auto normal = intersectionNormal(data, *intersection);
         auto const& point = intersection->point;
         auto const outgoing = -ray.direction;
 
@@ -139,6 +185,29 @@ inline FastFVec3 rayTrace(RayTraceData const& data, Line ray, FastRNG& randomEng
             normal = -normal;
         }
 
+        // Next event estimation.
+        if (auto const lightSample = data.lights.sample(randomEngine)) {
+            auto const toLight = lightSample->point - point;
+            auto const distanceSq = glm::dot(toLight, toLight);
+            auto const distance = std::sqrt(distanceSq);
+            auto const lightDirection = toLight / distance;
+            auto const nDotL = glm::dot(normal, lightDirection);
+            auto const lightCos = -glm::dot(lightSample->normal, lightDirection);
+            if (nDotL > 0.0f && lightCos > 0.0f) {
+                // Exclude the light's own tri at the end of the shadow ray.
+                auto const occluded = data.modelTree.occluded<SurfaceConsideration::FRONT_ONLY>(
+                    {point, lightDirection}, RAY_INTERSECTION_T_MIN, distance - RAY_INTERSECTION_T_MIN);
+                if (!occluded) {
+                    auto const lightHalfway = glm::normalize(outgoing + lightDirection);
+                    lightEmissions.insert(bounce, lightSample->emission.toGLMVec3());
+                    lightPdfs[bounce] = data.lights.areaPdf() * distanceSq / lightCos;
+                    lightNDotIs[bounce] = nDotL;
+                    lightNDotHs[bounce] = glm::dot(normal, lightHalfway);
+                    lightHDotOs[bounce] = glm::dot(lightHalfway, outgoing);
+                }
+            }
+        }
+
         auto const [perpendicular1, perpendicular2] = orthonormalBasis(normal);
 
         // Sample incident rays according to GGX distribution.
@@ -184,13 +253,25 @@ inline FastFVec3 rayTrace(RayTraceData const& data, Line ray, FastRNG& randomEng
     // Cook-Torrance BRDF.
     // assert(hDotO > 0.0f);
     auto const& hDotIs = hDotOs;
-    auto const specularFs = fresnel(f0s, hDotOs);
-    auto const specularDs = ndf(ndfAlphaSqs, nDotHs);
-    auto const specularGs = geometry(geometryAlphaSqs, nDotIs, nDotOs, hDotIs, hDotOs);
+    auto const specularFs = fresnelSchlick(f0s, hDotOs);
+    auto const specularDs = ggxNDF(ndfAlphaSqs, nDotHs);
+    auto const specularGs = ggxGeometry(geometryAlphaSqs, nDotIs, nDotOs, hDotIs, hDotOs);
     // ray probability = specularD * nDotH / (4 * hDotO)
     auto const diffuses = fnma(specularFs, adjustedColours, adjustedColours) * (4.0f * nDotIs * hDotOs / (specularDs * nDotHs));
     auto const speculars = specularFs * (specularGs * hDotOs / (nDotOs * nDotHs));
     auto const weights = diffuses + conditional(nDotOs > 0.0f, speculars, FVec3_8::zero());
+    auto const brdfPdfs = specularDs * nDotHs / (4.0f * hDotOs);
+
+    // BRDF for next event estimation directions, weighted by emitted light and MIS weight over light sample density.
+    auto const lightSpecularFs = fresnelSchlick(f0s, lightHDotOs);
+    auto const lightSpecularDs = ggxNDF(ndfAlphaSqs, lightNDotHs);
+    auto const lightSpecularGs = ggxGeometry(geometryAlphaSqs, lightNDotIs, nDotOs, lightHDotOs, lightHDotOs);
+    auto const lightBRDFPdfs = lightSpecularDs * lightNDotHs / (4.0f * lightHDotOs);
+    auto const lightMISWeights = square(lightPdfs) / (square(lightPdfs) + square(lightBRDFPdfs));
+    auto const lightDiffuses = fnma(lightSpecularFs, adjustedColours, adjustedColours) * lightNDotIs;
+    auto const lightSpeculars = lightSpecularFs * (lightSpecularGs * lightSpecularDs / (4.0f * nDotOs));
+    auto const directLights = conditional(lightPdfs > 0.0f,
+        (lightDiffuses + lightSpeculars) * lightEmissions * (lightMISWeights / lightPdfs), FVec3_8::zero());
 
     std::array<FastFVec3, RAY_DEPTH_LIMIT> lightWeights;
     lightWeights[0] = {1.0f, 1.0f, 1.0f};
@@ -203,7 +284,15 @@ inline FastFVec3 rayTrace(RayTraceData const& data, Line ray, FastRNG& randomEng
 
     FastFVec3 outgoingLight{0.0f, 0.0f, 0.0f};
     for (unsigned i = 0; i < depth; ++i) {
-        outgoingLight = fma(lightWeights[i], emissions[i], outgoingLight);
+        auto light = emissions[i];
+        if (i > 0 && emissionLightPdfs[i] > 0.0f) {
+            auto const brdfPdfSq = square(brdfPdfs[i - 1]);
+            light = light * (brdfPdfSq / (brdfPdfSq + square(emissionLightPdfs[i])));
+        }
+        if (i < RAY_BOUNCE_LIMIT) {
+            light += FastFVec3{directLights.extract(i)};
+        }
+        outgoingLight = fma(lightWeights[i], light, outgoingLight);
     }
 
     // TODO? light transmission
@@ -212,23 +301,179 @@ inline FastFVec3 rayTrace(RayTraceData const& data, Line ray, FastRNG& randomEng
 }
 
 
-inline void render(RenderData const& data, Span<glm::vec3> image) {
-    assert(image.size() == data.imageWidth * data.imageHeight);
-    // Note: cannot use std::execution::par_unseq due to thread_local random engine access.
-    std::transform(std::execution::par, IndexIterator<>{0}, IndexIterator<>{image.size()}, image.begin(),
-            [&data](std::size_t index) {
-        auto const pixelX = index % data.imageWidth;
-        auto const pixelY = index / data.imageWidth;
+// Per-pixel sample statistics for progressive rendering, where an image is rendered in multiple passes with a few
+// samples per pixel each, and the current estimate of the image is available after any pass.
+class AccumulationBuffer {
+public:
+    // Samples of a single pixel.
+    struct Samples {
+        glm::vec3 sum;
+        double luminanceSquareSum;      // For variance estimation.
+        std::uint32_t count;
+    };
+
+    AccumulationBuffer(unsigned width, unsigned height) :
+        _width{width}, _height{height}, _samples(width * height, Samples{glm::vec3{0.0f}, 0.0, 0})
+    {}
+
+    unsigned width() const {
+        return _width;
+    }
+
+    unsigned height() const {
+        return _height;
+    }
+
+    void add(std::size_t pixel, Samples const& samples) {
+        auto& pixelSamples = _samples[pixel];
+        pixelSamples.sum += samples.sum;
+        pixelSamples.luminanceSquareSum += samples.luminanceSquareSum;
+        pixelSamples.count += samples.count;
+    }
+
+    // Total number of samples over all pixels.
+    std::uint64_t sampleCount() const {
+        std::uint64_t count = 0;
+        for (auto const& samples : _samples) {
+            count += samples.count;
+        }
+        return count;
+    }
+
+    // Estimates the error of a pixel's current estimate, as the standard error of its luminance after tone mapping and
+    // sRGB conversion. This approximates the perceived error, which is much lower in bright regions.
+    float error(std::size_t pixel) const {
+        auto const& samples = _samples[pixel];
+        if (samples.count < 2) {
+            return INFINITY;
+        }
+        auto const luminanceSum = static_cast<double>(luminance(samples.sum));
+        auto const mean = luminanceSum / samples.count;
+        auto const variance = std::max((samples.luminanceSquareSum - mean * luminanceSum) / (samples.count - 1), 0.0);
+        auto const standardError = static_cast<float>(std::sqrt(variance / samples.count));
+        auto const display = [](float luminance) {
+            return linearToSRGB(reinhardToneMap(luminance));
+        };
+        return display(static_cast<float>(mean) + standardError) - display(static_cast<float>(mean));
+    }
+
+    // Checks if a pixel should be sampled further: it has fewer than the minimum number of samples, or its error is
+    // above the threshold, and it has fewer than the maximum number of samples.
+    // Pixels are only sampled while they need samples, so once a pixel no longer needs samples, it never will again.
+    bool needsSamples(std::size_t pixel, float errorThreshold) const {
+        auto const count = _samples[pixel].count;
+        return count < PIXEL_MAX_SAMPLE_RATE && (count < PIXEL_MIN_SAMPLE_RATE || error(pixel) > errorThreshold);
+    }
+
+    // Computes the current estimate of each pixel, i.e. the mean of its samples.
+    void estimate(Span<glm::vec3> image) const {
+        assert(image.size() == _samples.size());
+        std::transform(_samples.cbegin(), _samples.cend(), image.begin(), [](Samples const& samples) {
+            return samples.count > 0 ? samples.sum / static_cast<float>(samples.count) : glm::vec3{0.0f};
+        });
+    }
+
+private:
+    unsigned _width;
+    unsigned _height;
+    std::vector<Samples> _samples;
+};
+
+
+// Renders one progressive pass, adding a number of samples to each pixel which needs samples (see
+// AccumulationBuffer::needsSamples()).
+// Returns the number of pixels sampled, which is 0 once all pixels have converged or reached the maximum samples.
+// Renders tile by tile. Each thread renders a tile into its own buffer, then adds it into the accumulation buffer.
+inline std::size_t renderPass(RenderData const& data, AccumulationBuffer& accumulation, unsigned samplesPerPixel,
+        float errorThreshold, TileScheduler& scheduler) {
+    assert(accumulation.width() == data.imageWidth && accumulation.height() == data.imageHeight);
+    std::vector<std::vector<AccumulationBuffer::Samples>> tileBuffers(scheduler.threadCount());
+    std::atomic<std::size_t> sampledPixels{0};
+    scheduler.run([&data, &accumulation, samplesPerPixel, errorThreshold, &tileBuffers, &sampledPixels]
+            (Tile const& tile, unsigned threadIndex) {
         auto& randomEngine = ::randomEngine;    // Access random engine here to force static initialisation.
-        FastFVec3 colour{0.0f, 0.0f, 0.0f};
-        for (unsigned i = 0; i < PIXEL_SAMPLE_RATE; ++i) {
-            auto const sampleX = pixelX + randomEngine.unitFloatOpen();
-            auto const sampleY = pixelY + randomEngine.unitFloatOpen();
-            auto const rayDirection = glm::normalize(data.pixelToRayTransform * glm::vec3{sampleX, sampleY, 1.0f});
-            Line const ray{data.cameraPosition, rayDirection};
-            colour += rayTrace(data.rayTraceData, ray, randomEngine);
+        auto& tileBuffer = tileBuffers[threadIndex];
+        tileBuffer.resize(tile.width * tile.height);
+        std::size_t tileSampledPixels = 0;
+        for (unsigned y = 0; y < tile.height; ++y) {
+            for (unsigned x = 0; x < tile.width; ++x) {
+                auto const pixelX = tile.x + x;
+                auto const pixelY = tile.y + y;
+                auto& samples = tileBuffer[y * tile.width + x];
+                samples = {glm::vec3{0.0f}, 0.0, 0};
+                if (!accumulation.needsSamples(static_cast<std::size_t>(pixelY) * data.imageWidth + pixelX,
+                        errorThreshold)) {
+                    continue;
+                }
+                FastFVec3 colour{0.0f, 0.0f, 0.0f};
+                // Camera rays through the same pixel are almost parallel, so they are intersected with the scene in
+                // packets. The last packet is padded with copies of its first ray, whose results are discarded.
+                for (unsigned i = 0; i < samplesPerPixel; i += LINE_PACKET_SIZE) {
+                    auto const packetSize = std::min(samplesPerPixel - i, LINE_PACKET_SIZE);
+                    LinePacket rays{data.cameraPosition, FVec3_8::zero()};
+                    for (unsigned j = 0; j < LINE_PACKET_SIZE; ++j) {
+                        if (j < packetSize) {
+                            auto const sampleX = pixelX + randomEngine.unitFloatOpen();
+                            auto const sampleY = pixelY + randomEngine.unitFloatOpen();
+                            rays.directions.insert(j,
+                                glm::normalize(data.pixelToRayTransform * glm::vec3{sampleX, sampleY, 1.0f}));
+                        }
+                        else {
+                            rays.directions.insert(j, rays.directions.extract(0));
+                        }
+                    }
+                    auto const intersections = data.rayTraceData.modelTree
+                        .lineTriNearestIntersections<SurfaceConsideration::FRONT_ONLY>(rays, RAY_INTERSECTION_T_MIN);
+                    for (unsigned j = 0; j < packetSize; ++j) {
+                        auto const sample = rayTrace(data.rayTraceData, rays.line(j), intersections[j], randomEngine);
+                        colour += sample;
+                        samples.luminanceSquareSum += square(static_cast<double>(luminance(sample.toGLMVec3())));
+                    }
+                }
+                samples.sum = colour.toGLMVec3();
+                samples.count = samplesPerPixel;
+                ++tileSampledPixels;
+            }
         }
-        colour /= PIXEL_SAMPLE_RATE;
-        return colour.toGLMVec3();
+        for (unsigned y = 0; y < tile.height; ++y) {
+            for (unsigned x = 0; x < tile.width; ++x) {
+                auto const pixel = static_cast<std::size_t>(tile.y + y) * data.imageWidth + tile.x + x;
+                accumulation.add(pixel, tileBuffer[y * tile.width + x]);
+            }
+        }
+        sampledPixels.fetch_add(tileSampledPixels, std::memory_order_relaxed);
     });
+    return sampledPixels.load();
+}
+
+
+inline std::size_t renderPass(RenderData const& data, AccumulationBuffer& accumulation, unsigned samplesPerPixel,
+        float errorThreshold = PIXEL_ERROR_THRESHOLD) {
+    TileScheduler scheduler{data.imageWidth, data.imageHeight, RENDER_TILE_SIZE};
+    return renderPass(data, accumulation, samplesPerPixel, errorThreshold, scheduler);
+}
+
+
+// Number of samples per pixel for the next progressive pass, such that rendering uses at most a total sample budget.
+// sampledPixels is the number of pixels sampled by the previous pass, or all pixels before the first pass. Pixels which
+// stop needing samples never need them again, so this bounds the number of pixels the next pass samples.
+// Returns 0 once the budget doesn't allow another sample for each of those pixels.
+inline unsigned passSampleRate(std::uint64_t remainingSamples, std::size_t sampledPixels) {
+    if (sampledPixels == 0) {
+        return 0;
+    }
+    return static_cast<unsigned>(std::min<std::uint64_t>(PASS_SAMPLE_RATE, remainingSamples / sampledPixels));
+}
+
+
+// Renders the entire image with PIXEL_SAMPLE_RATE samples per pixel on average.
+inline void render(RenderData const& data, Span<glm::vec3> image) {
+    AccumulationBuffer accumulation{data.imageWidth, data.imageHeight};
+    std::size_t sampledPixels = static_cast<std::size_t>(data.imageWidth) * data.imageHeight;
+    auto remainingSamples = std::uint64_t{PIXEL_SAMPLE_RATE} * sampledPixels;
+    while (auto const passSamples = passSampleRate(remainingSamples, sampledPixels)) {
+        sampledPixels = renderPass(data, accumulation, passSamples);
+        remainingSamples -= std::uint64_t{passSamples} * sampledPixels;
+    }
+    accumulation.estimate(image);
 }
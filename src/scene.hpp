@@ -35,7 +35,6 @@ struct Scene {
         std::vector<MeshIndex> meshes;      // Maps from model index to base mesh index.
         std::vector<MaterialIndex> materials;       // Maps from model index to material index.
     } models;
-    InstantiatedMeshes instantiatedMeshes;
     PreprocessedTris preprocessedTris;
     std::vector<PreprocessedMaterial> preprocessedMaterials;
 };
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "geometry.hpp"
+#include "index_types.hpp"
+#include "material.hpp"
+#include "mesh_tree.hpp"
+#include "scene.hpp"
+#include "utility/binary_cache.hpp"
+#include "utility/mapped_file.hpp"
+#include "utility/span.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Scene data derived from the meshes and materials, which is independent of the camera and render settings.
+struct PreprocessedScene {
+    Span<PreprocessedMaterial const> materials;
+    Span<PreprocessedTri const> tris;
+    Span<TriRange const> triRanges;         // Maps from mesh index to range of preprocessed tris.
+    std::vector<MeshTree> meshTrees;        // Maps from mesh index to the mesh's tree.
+    std::optional<MappedFile> cacheFile;    // Memory viewed by the above if loaded from a cache.
+};
+
+
+// SCENE CACHE FILE:
+//   Stores a PreprocessedScene such that it can be memory-mapped and used in place (see binary_cache.hpp).
+//   Layout: magic, version, scene hash, preprocessed materials, preprocessed tris, tri ranges, mesh count, mesh trees.
+//   The version must be incremented whenever the layout or any of the stored types change.
+
+constexpr inline std::array<char, 8> SCENE_CACHE_MAGIC{'R', 'T', 'S', 'C', 'A', 'C', 'H', 'E'};
+constexpr inline std::uint32_t SCENE_CACHE_VERSION = 10;
+
+
+// Hashes the scene inputs which the preprocessed scene is derived from.
+inline std::uint64_t hashSceneInputs(Meshes const& meshes, Span<Material const> materials, MeshTreeType meshTreeType) {
+    BinaryHasher hasher;
+    hasher.add(SCENE_CACHE_VERSION);
+    hasher.add(meshTreeType);
+    hasher.addArray(readOnlySpan(meshes.vertexPositions));
+    hasher.addArray(readOnlySpan(meshes.tris));
+    hasher.addArray(readOnlySpan(meshes.vertexRanges));
+    hasher.addArray(readOnlySpan(meshes.triRanges));
+    hasher.addArray(materials);
+    return hasher.hash();
+}
+
+
+// Loads a scene cache file, if it exists and matches the scene hash.
+inline std::optional<PreprocessedScene> loadSceneCache(char const* path, std::uint64_t sceneHash) {
+    auto file = MappedFile::open(path);
+    if (!file) {
+        return std::nullopt;
+    }
+    CacheReader reader{file->contents()};
+    if (reader.read<std::array<char, 8>>() != SCENE_CACHE_MAGIC
+            || reader.read<std::uint32_t>() != SCENE_CACHE_VERSION || reader.read<std::uint64_t>() != sceneHash) {
+        return std::nullopt;
+    }
+    PreprocessedScene scene{
+        reader.readArray<PreprocessedMaterial>(),
+        reader.readArray<PreprocessedTri>(),
+        reader.readArray<TriRange>(),
+        {},
+        std::nullopt
+    };
+    auto const meshCount = reader.read<std::uint64_t>();
+    if (!reader.valid() || meshCount != scene.triRanges.size()) {
+        return std::nullopt;
+    }
+    scene.meshTrees.reserve(meshCount);
+    for (std::uint64_t i = 0; i < meshCount; ++i) {
+        auto tree = MeshTree::read(reader);
+        if (!tree) {
+            return std::nullopt;
+        }
+        scene.meshTrees.push_back(std::move(*tree));
+    }
+    if (!reader.valid()) {
+        return std::nullopt;
+    }
+    // Moving the mapping doesn't change its address, so the views remain valid.
+    scene.cacheFile = std::move(file);
+    return scene;
+}
+
+
+// Writes a scene cache file. Written to a temporary file first so that a partially written cache is never loaded.
+inline bool saveSceneCache(char const* path, std::uint64_t sceneHash, PreprocessedScene const& scene) {
+    auto const tempPath = std::string{path} + ".tmp";
+    {
+        std::ofstream output{tempPath, std::ofstream::binary | std::ofstream::out | std::ofstream::trunc};
+        CacheWriter writer{output};
+        writer.write(SCENE_CACHE_MAGIC);
+        writer.write(SCENE_CACHE_VERSION);
+        writer.write(sceneHash);
+        writer.writeArray(scene.materials);
+        writer.writeArray(scene.tris);
+        writer.writeArray(scene.triRanges);
+        writer.write(static_cast<std::uint64_t>(scene.meshTrees.size()));
+        for (auto const& tree : scene.meshTrees) {
+            tree.write(writer);
+        }
+        if (!output) {
+            return false;
+        }
+    }
+    std::remove(path);
+    return std::rename(tempPath.c_str(), path) == 0;
+}
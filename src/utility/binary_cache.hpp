@@ -0,0 +1,136 @@
+#pragma once
+
+#include "span.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <type_traits>
+
+
+// Binary cache files store trivially copyable values and arrays in native layout, so that they can be used in place
+// from a memory-mapped file without deserialisation.
+// Arrays are stored as their size, followed by the elements at the next multiple of CACHE_ALIGNMENT bytes.
+
+
+constexpr inline std::size_t CACHE_ALIGNMENT = 64;
+
+
+// Computes FNV-1a hashes of binary data.
+class BinaryHasher {
+public:
+    template<typename T>
+    void add(T const& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        _addBytes(reinterpret_cast<std::byte const*>(&value), sizeof(T));
+    }
+
+    template<typename T>
+    void addArray(Span<T const> values) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        add(static_cast<std::uint64_t>(values.size()));
+        _addBytes(reinterpret_cast<std::byte const*>(values.data()), values.size() * sizeof(T));
+    }
+
+    std::uint64_t hash() const {
+        return _hash;
+    }
+
+private:
+    std::uint64_t _hash = 0xCBF29CE484222325;
+
+    void _addBytes(std::byte const* bytes, std::size_t size) {
+        for (std::size_t i = 0; i < size; ++i) {
+            _hash ^= static_cast<std::uint64_t>(bytes[i]);
+            _hash *= 0x100000001B3;
+        }
+    }
+};
+
+
+class CacheWriter {
+public:
+    explicit CacheWriter(std::ostream& stream) :
+        _stream{stream}, _offset{0}
+    {}
+
+    template<typename T>
+    void write(T const& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        _writeBytes(reinterpret_cast<char const*>(&value), sizeof(T));
+    }
+
+    template<typename T>
+    void writeArray(Span<T const> values) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        static_assert(CACHE_ALIGNMENT % alignof(T) == 0);
+        write(static_cast<std::uint64_t>(values.size()));
+        static constexpr std::array<char, CACHE_ALIGNMENT> PADDING{};
+        _writeBytes(PADDING.data(), (CACHE_ALIGNMENT - _offset % CACHE_ALIGNMENT) % CACHE_ALIGNMENT);
+        _writeBytes(reinterpret_cast<char const*>(values.data()), values.size() * sizeof(T));
+    }
+
+private:
+    std::ostream& _stream;
+    std::size_t _offset;
+
+    void _writeBytes(char const* bytes, std::size_t size) {
+        _stream.write(bytes, size);
+        _offset += size;
+    }
+};
+
+
+// Reads data written by CacheWriter. Arrays are viewed in place, so the data must outlive them.
+// Data must begin at a multiple of CACHE_ALIGNMENT bytes.
+// Reading past the end of the data invalidates the reader, after which reads produce empty results.
+class CacheReader {
+public:
+    explicit CacheReader(Span<std::byte const> data) :
+        _data{data}, _offset{0}, _valid{reinterpret_cast<std::uintptr_t>(data.data()) % CACHE_ALIGNMENT == 0}
+    {}
+
+    bool valid() const {
+        return _valid;
+    }
+
+    template<typename T>
+    T read() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value{};
+        if (_reserve(sizeof(T))) {
+            std::memcpy(&value, _data.data() + _offset, sizeof(T));
+            _offset += sizeof(T);
+        }
+        return value;
+    }
+
+    template<typename T>
+    Span<T const> readArray() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        static_assert(CACHE_ALIGNMENT % alignof(T) == 0);
+        auto const size = read<std::uint64_t>();
+        auto const padding = (CACHE_ALIGNMENT - _offset % CACHE_ALIGNMENT) % CACHE_ALIGNMENT;
+        if (!_reserve(padding) || size > (_data.size() - _offset - padding) / sizeof(T)) {
+            _valid = false;
+            return {};
+        }
+        _offset += padding;
+        Span<T const> const values{reinterpret_cast<T const*>(_data.data() + _offset), static_cast<std::size_t>(size)};
+        _offset += values.size() * sizeof(T);
+        return values;
+    }
+
+private:
+    Span<std::byte const> _data;
+    std::size_t _offset;
+    bool _valid;
+
+    // Checks that a number of bytes can be read.
+    bool _reserve(std::size_t size) {
+        _valid = _valid && size <= _data.size() - _offset;
+        return _valid;
+    }
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "span.hpp"
+
+#include <cstddef>
+#include <optional>
+#include <utility>
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <Windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+
+// Read-only memory mapping of an entire file.
+class MappedFile {
+public:
+    // Maps a file into memory. Fails if the file can't be opened or is empty.
+    static std::optional<MappedFile> open(char const* path) {
+#ifdef _WIN32
+        auto const file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return std::nullopt;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            CloseHandle(file);
+            return std::nullopt;
+        }
+        auto const mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+        if (mapping == nullptr) {
+            return std::nullopt;
+        }
+        // The view keeps the mapping alive.
+        auto const data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (data == nullptr) {
+            return std::nullopt;
+        }
+        return MappedFile{static_cast<std::byte const*>(data), static_cast<std::size_t>(size.QuadPart)};
+#else
+        auto const file = ::open(path, O_RDONLY);
+        if (file < 0) {
+            return std::nullopt;
+        }
+        struct stat status;
+        if (fstat(file, &status) != 0 || status.st_size <= 0) {
+            close(file);
+            return std::nullopt;
+        }
+        auto const size = static_cast<std::size_t>(status.st_size);
+        // The mapping stays valid after the file is closed.
+        auto const data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+        close(file);
+        if (data == MAP_FAILED) {
+            return std::nullopt;
+        }
+        return MappedFile{static_cast<std::byte const*>(data), size};
+#endif
+    }
+
+    MappedFile(MappedFile const&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept :
+        _data{std::exchange(other._data, nullptr)}, _size{std::exchange(other._size, 0)}
+    {}
+
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        std::swap(_data, other._data);
+        std::swap(_size, other._size);
+        return *this;
+    }
+
+    ~MappedFile() {
+        if (_data != nullptr) {
+#ifdef _WIN32
+            UnmapViewOfFile(_data);
+#else
+            munmap(const_cast<std::byte*>(_data), _size);
+#endif
+        }
+    }
+
+    // Contents of the file. Begins at a page boundary.
+    Span<std::byte const> contents() const {
+        return {_data, _size};
+    }
+
+private:
+    std::byte const* _data;
+    std::size_t _size;
+
+    MappedFile(std::byte const* data, std::size_t size) :
+        _data{data}, _size{size}
+    {}
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "vectorised.hpp"
+
 #include <cassert>
 #include <cmath>
 #include <utility>
@@ -52,3 +54,15 @@ inline std::pair<glm::vec3, glm::vec3> orthonormalBasis(glm::vec3 vec) {
     auto const perpendicular2 = glm::cross(vec, perpendicular1);
     return {perpendicular1, perpendicular2};
 }
+
+
+// Same as orthonormalBasis(glm::vec3), for 8 vectors at once.
+inline std::pair<FVec3_8, FVec3_8> orthonormalBasis(FVec3_8 vec) {
+    FVec3_8 const vec2{FVec8{0.56863665f}, FVec8{-0.77215318f}, FVec8{0.28360506f}};
+    FVec3_8 const parallelVec2{FVec8{0.56863665f}, FVec8{0.77215318f}, FVec8{0.28360506f}};
+    auto const parallel = abs(1.0f - abs(dot(vec, vec2))) < FVec8{1e-3f};
+    auto const chosenVec2 = conditional(parallel, parallelVec2, vec2);
+    auto const perpendicular1 = normalize(chosenVec2 - vec * dot(vec, chosenVec2));
+    auto const perpendicular2 = cross(vec, perpendicular1);
+    return {perpendicular1, perpendicular2};
+}
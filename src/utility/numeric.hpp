@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
 #include <limits>
 #include <type_traits>
 
@@ -39,3 +40,13 @@ To intCast(From val) {
     }
     return static_cast<To>(val);
 }
+
+
+// Smallest n such that 2^n >= val.
+constexpr unsigned ceilLog2(std::uint64_t val) {
+    unsigned n = 0;
+    while (n < 64 && (std::uint64_t{1} << n) < val) {
+        ++n;
+    }
+    return n;
+}
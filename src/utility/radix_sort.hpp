@@ -0,0 +1,128 @@
+#pragma once
+
+#include "index_iterator.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <execution>
+#include <thread>
+#include <vector>
+
+
+// Sorts elements ascending by an unsigned integer key, with a least significant digit radix sort. Stable.
+// Serial, for sorting many small sets from within worker threads. scratch is resized to the element count and
+// reused, so passing the same scratch buffer to repeated sorts avoids reallocating it.
+// Passes over digits which are the same for all elements are skipped.
+template<typename T, typename GetKey>
+void radixSort(std::vector<T>& elements, std::vector<T>& scratch, GetKey getKey) {
+    constexpr unsigned DIGIT_BITS = 8;
+    constexpr std::size_t DIGIT_VALUES = std::size_t{1} << DIGIT_BITS;
+
+    using Key = decltype(getKey(elements.front()));
+
+    if (elements.size() < 2) {
+        return;
+    }
+
+    scratch.resize(elements.size());
+    std::array<std::size_t, DIGIT_VALUES> offsets;
+    for (unsigned shift = 0; shift < sizeof(Key) * 8; shift += DIGIT_BITS) {
+        auto const digit = [&getKey, shift](T const& element) {
+            return static_cast<std::size_t>((getKey(element) >> shift) & (DIGIT_VALUES - 1));
+        };
+
+        offsets.fill(0);
+        for (auto const& element : elements) {
+            ++offsets[digit(element)];
+        }
+
+        // Convert the histogram to output offsets.
+        std::size_t offset = 0;
+        bool singleDigit = false;
+        for (auto& count : offsets) {
+            singleDigit = singleDigit || count == elements.size();
+            auto const valueCount = count;
+            count = offset;
+            offset += valueCount;
+        }
+        if (singleDigit) {
+            continue;
+        }
+
+        for (auto const& element : elements) {
+            scratch[offsets[digit(element)]++] = element;
+        }
+        elements.swap(scratch);
+    }
+}
+
+
+// Sorts elements ascending by an unsigned integer key, with a least significant digit radix sort. Stable.
+// Each pass over a digit is parallelised by dividing the elements into chunks: every chunk's digit histogram is
+// computed in parallel, then every chunk scatters its elements to its own precomputed output ranges in parallel.
+// Passes over digits which are the same for all elements are skipped.
+template<typename T, typename GetKey>
+void parallelRadixSort(std::vector<T>& elements, GetKey getKey) {
+    constexpr unsigned DIGIT_BITS = 8;
+    constexpr std::size_t DIGIT_VALUES = std::size_t{1} << DIGIT_BITS;
+    constexpr std::size_t MIN_CHUNK_SIZE = 16384;
+
+    using Key = decltype(getKey(elements.front()));
+    using Histogram = std::array<std::size_t, DIGIT_VALUES>;
+
+    if (elements.size() < 2) {
+        return;
+    }
+
+    auto const maxChunkCount = std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+    auto const chunkCount = std::clamp<std::size_t>(elements.size() / MIN_CHUNK_SIZE, 1, maxChunkCount);
+    auto const chunkSize = (elements.size() + chunkCount - 1) / chunkCount;
+    auto const chunkBegin = [&elements, chunkSize](std::size_t chunk) {
+        return std::min(chunk * chunkSize, elements.size());
+    };
+
+    std::vector<T> scratch(elements.size());
+    std::vector<Histogram> histograms(chunkCount);
+    for (unsigned shift = 0; shift < sizeof(Key) * 8; shift += DIGIT_BITS) {
+        auto const digit = [&getKey, shift](T const& element) {
+            return static_cast<std::size_t>((getKey(element) >> shift) & (DIGIT_VALUES - 1));
+        };
+
+        std::for_each(std::execution::par, IndexIterator{std::size_t{0}}, IndexIterator{chunkCount},
+                [&](std::size_t chunk) {
+            auto& histogram = histograms[chunk];
+            histogram.fill(0);
+            for (auto i = chunkBegin(chunk); i < chunkBegin(chunk + 1); ++i) {
+                ++histogram[digit(elements[i])];
+            }
+        });
+
+        // Convert the histograms to output offsets, ordered by digit then chunk, which keeps the sort stable.
+        std::size_t offset = 0;
+        bool singleDigit = false;
+        for (std::size_t value = 0; value < DIGIT_VALUES; ++value) {
+            std::size_t valueCount = 0;
+            for (auto& histogram : histograms) {
+                auto const count = histogram[value];
+                histogram[value] = offset;
+                offset += count;
+                valueCount += count;
+            }
+            singleDigit = singleDigit || valueCount == elements.size();
+        }
+        if (singleDigit) {
+            continue;
+        }
+
+        std::for_each(std::execution::par, IndexIterator{std::size_t{0}}, IndexIterator{chunkCount},
+                [&](std::size_t chunk) {
+            auto& offsets = histograms[chunk];
+            for (auto i = chunkBegin(chunk); i < chunkBegin(chunk + 1); ++i) {
+                scratch[offsets[digit(elements[i])]++] = elements[i];
+            }
+        });
+        elements.swap(scratch);
+    }
+}
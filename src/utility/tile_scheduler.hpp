@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+
+// Rectangular region of an image.
+struct Tile {
+    unsigned x;
+    unsigned y;
+    unsigned width;
+    unsigned height;
+};
+
+
+// Distributes the tiles of an image across worker threads.
+// Each worker has its own deque of tiles, initially a contiguous run of tiles so neighbouring tiles are processed by
+// the same worker. A worker takes tiles from the front of its own deque, and when it runs out, steals from the back
+// of other workers' deques, which balances load across regions which are expensive to process.
+class TileScheduler {
+public:
+    TileScheduler(unsigned imageWidth, unsigned imageHeight, unsigned tileSize,
+            unsigned threadCount = std::max(std::thread::hardware_concurrency(), 1u)) :
+        _workers(threadCount), _tileCount{0}, _completedTiles{0}, _cancelled{false}
+    {
+        assert(tileSize > 0);
+        assert(threadCount > 0);
+
+        std::vector<Tile> tiles;
+        for (unsigned y = 0; y < imageHeight; y += tileSize) {
+            for (unsigned x = 0; x < imageWidth; x += tileSize) {
+                tiles.push_back({x, y, std::min(tileSize, imageWidth - x), std::min(tileSize, imageHeight - y)});
+            }
+        }
+        _tileCount = tiles.size();
+        for (std::size_t i = 0; i < threadCount; ++i) {
+            auto const begin = tiles.cbegin() + tiles.size() * i / threadCount;
+            auto const end = tiles.cbegin() + tiles.size() * (i + 1) / threadCount;
+            _workers[i].tiles.assign(begin, end);
+        }
+    }
+
+    // Processes all tiles, blocking until done or cancelled. func is called as func(tile, threadIndex), concurrently
+    // for different tiles. Tiles processed by the same thread are never processed concurrently.
+    template<typename Func>
+    void run(Func&& func) {
+        auto const work = [this, &func](unsigned threadIndex) {
+            while (!_cancelled.load(std::memory_order_relaxed)) {
+                auto const tile = _takeTile(threadIndex);
+                if (!tile) {
+                    break;
+                }
+                func(*tile, threadIndex);
+                _completedTiles.fetch_add(1, std::memory_order_relaxed);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        threads.reserve(_workers.size() - 1);
+        for (unsigned i = 1; i < _workers.size(); ++i) {
+            threads.emplace_back(work, i);
+        }
+        work(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Stops workers from starting new tiles. Tiles in progress are completed.
+    void cancel() {
+        _cancelled.store(true, std::memory_order_relaxed);
+    }
+
+    unsigned threadCount() const {
+        return static_cast<unsigned>(_workers.size());
+    }
+
+    std::size_t tileCount() const {
+        return _tileCount;
+    }
+
+    // Number of tiles which have been processed so far. Safe to call while running, for progress reporting.
+    std::size_t completedTiles() const {
+        return _completedTiles.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+
+    std::vector<Worker> _workers;
+    std::size_t _tileCount;
+    std::atomic<std::size_t> _completedTiles;
+    std::atomic<bool> _cancelled;
+
+    // Takes the next tile from a worker's own deque, else steals one from another worker.
+    std::optional<Tile> _takeTile(unsigned threadIndex) {
+        {
+            auto& worker = _workers[threadIndex];
+            std::lock_guard const lock{worker.mutex};
+            if (!worker.tiles.empty()) {
+                auto const tile = worker.tiles.front();
+                worker.tiles.pop_front();
+                return tile;
+            }
+        }
+        // Tiles are never added, so once all deques are seen to be empty, there is no more work.
+        for (std::size_t i = 1; i < _workers.size(); ++i) {
+            auto& victim = _workers[(threadIndex + i) % _workers.size()];
+            std::lock_guard const lock{victim.mutex};
+            if (!victim.tiles.empty()) {
+                auto const tile = victim.tiles.back();
+                victim.tiles.pop_back();
+                return tile;
+            }
+        }
+        return std::nullopt;
+    }
+};
@@ -64,7 +64,7 @@ struct FastFVec3 {
         data{f}
     {}
 
-    glm::vec3 toGLMVec3() {
+    glm::vec3 toGLMVec3() const {
         return {data[0], data[1], data[2]};
     }
 
@@ -114,6 +114,18 @@ struct FVec8 {
 };
 
 
+// Array of 4 32-bit unsigned integers with vectorised operations.
+struct U32Vec4 {
+    __m128i data;
+
+    U32Vec4() = default;
+
+    explicit U32Vec4(__m128i data) :
+        data{data}
+    {}
+};
+
+
 // Array of 8 32-bit unsigned integers with vectorisated operations.
 struct U32Vec8 {
     __m256i data;
@@ -266,10 +278,23 @@ inline FVec3_8 operator-(glm::vec3 a, FVec3_8 b) {
 }
 
 
+inline FVec3_8 operator-(FVec3_8 a, FVec3_8 b) {
+    return {
+        a.x - b.x,
+        a.y - b.y,
+        a.z - b.z
+    };
+}
+
+
 inline FVec8 operator-(FVec8 v) {
     return FVec8::zero() - v;
 }
 
+inline FVec3_8 operator-(FVec3_8 v) {
+    return {-v.x, -v.y, -v.z};
+}
+
 
 inline FVec4 operator*(FVec4 a, FVec4 b) {
     return FVec4{_mm_mul_ps(a.data, b.data)};
@@ -344,12 +369,40 @@ inline FVec8 operator/(float a, FVec8 b) {
     return FVec8{a} / b;
 }
 
+inline FVec3_8 operator/(FVec3_8 a, FVec8 b) {
+    return {
+        a.x / b,
+        a.y / b,
+        a.z / b
+    };
+}
+
 
 inline U32Vec8 operator&(U32Vec8 a, U32Vec8 b) {
     return U32Vec8{_mm256_and_si256(a.data, b.data)};
 }
 
 
+// Checks if any bit is set.
+inline bool any(U32Vec8 v) {
+    return !_mm256_testz_si256(v.data, v.data);
+}
+
+
+// Packs the most significant bit of each element into the low 8 bits of an integer, e.g. for comparison results.
+inline unsigned bitmask(U32Vec8 v) {
+    return static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(v.data)));
+}
+
+
+// Inverse of bitmask(): sets all bits of element i if bit i of the low 8 bits of an integer is set.
+inline U32Vec8 unpackBitmask(unsigned bits) {
+    auto const elementBits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    return U32Vec8{_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(static_cast<int>(bits)), elementBits),
+        elementBits)};
+}
+
+
 inline FastFVec3& operator+=(FastFVec3& lhs, FastFVec3 rhs) {
     lhs = lhs + rhs;
     return lhs;
@@ -373,8 +426,21 @@ inline FastFVec3& operator/=(FastFVec3& lhs, float rhs) {
 }
 
 
+inline U32Vec4 operator<(FVec4 a, FVec4 b) {
+    return U32Vec4{_mm_castps_si128(_mm_cmplt_ps(a.data, b.data))};
+}
+
+inline U32Vec8 operator<(FVec8 a, FVec8 b) {
+    return U32Vec8{_mm256_castps_si256(_mm256_cmp_ps(a.data, b.data, _CMP_LT_OQ))};
+}
+
+
+inline U32Vec8 operator<=(FVec8 a, FVec8 b) {
+    return U32Vec8{_mm256_castps_si256(_mm256_cmp_ps(a.data, b.data, _CMP_LE_OQ))};
+}
+
 inline U32Vec8 operator<=(FVec8 a, float b) {
-    return U32Vec8{_mm256_castps_si256(_mm256_cmp_ps(a.data, FVec8{b}.data, _CMP_LE_OQ))};
+    return a <= FVec8{b};
 }
 
 
@@ -397,6 +463,53 @@ inline FVec8 abs(FVec8 v) {
 }
 
 
+inline FVec4 floor(FVec4 v) {
+    return FVec4{_mm_floor_ps(v.data)};
+}
+
+inline FVec8 floor(FVec8 v) {
+    return FVec8{_mm256_floor_ps(v.data)};
+}
+
+
+// Elementwise minimum. Where either element is NaN, the element of b is returned.
+inline FVec4 min(FVec4 a, FVec4 b) {
+    return FVec4{_mm_min_ps(a.data, b.data)};
+}
+
+// Elementwise minimum. Where either element is NaN, the element of b is returned.
+inline FVec8 min(FVec8 a, FVec8 b) {
+    return FVec8{_mm256_min_ps(a.data, b.data)};
+}
+
+
+// Elementwise maximum. Where either element is NaN, the element of b is returned.
+inline FVec4 max(FVec4 a, FVec4 b) {
+    return FVec4{_mm_max_ps(a.data, b.data)};
+}
+
+// Elementwise maximum. Where either element is NaN, the element of b is returned.
+inline FVec8 max(FVec8 a, FVec8 b) {
+    return FVec8{_mm256_max_ps(a.data, b.data)};
+}
+
+
+// Minimum of the first 3 elements.
+inline float min3(FVec4 v) {
+    auto const yzx = _mm_shuffle_ps(v.data, v.data, _MM_SHUFFLE(3, 0, 2, 1));
+    auto const zxy = _mm_shuffle_ps(v.data, v.data, _MM_SHUFFLE(3, 1, 0, 2));
+    return _mm_cvtss_f32(_mm_min_ps(_mm_min_ps(v.data, yzx), zxy));
+}
+
+
+// Maximum of the first 3 elements.
+inline float max3(FVec4 v) {
+    auto const yzx = _mm_shuffle_ps(v.data, v.data, _MM_SHUFFLE(3, 0, 2, 1));
+    auto const zxy = _mm_shuffle_ps(v.data, v.data, _MM_SHUFFLE(3, 1, 0, 2));
+    return _mm_cvtss_f32(_mm_max_ps(_mm_max_ps(v.data, yzx), zxy));
+}
+
+
 inline FVec8 sqrt(FVec8 v) {
     return FVec8{_mm256_sqrt_ps(v.data)};
 }
@@ -441,6 +554,11 @@ inline FVec3_8 fnma(FVec3_8 a, FVec3_8 b, FVec3_8 c) {
     };
 }
 
+// -a*b + c
+inline glm::vec3 fnma(glm::vec3 a, glm::vec3 b, glm::vec3 c) {
+    return c - a * b;
+}
+
 
 // a*b - c
 inline FVec8 fms(FVec8 a, FVec8 b, FVec8 c) {
@@ -448,6 +566,11 @@ inline FVec8 fms(FVec8 a, FVec8 b, FVec8 c) {
 }
 
 
+// Elementwise choice between trueVal and falseVal depending on cond.
+inline FVec4 conditional(U32Vec4 cond, FVec4 trueVal, FVec4 falseVal) {
+    return FVec4{_mm_blendv_ps(falseVal.data, trueVal.data, _mm_castsi128_ps(cond.data))};
+}
+
 // Elementwise choice between trueVal and falseVal depending on cond.
 inline FVec8 conditional(U32Vec8 cond, FVec8 trueVal, FVec8 falseVal) {
     return FVec8{_mm256_blendv_ps(falseVal.data, trueVal.data, _mm256_castsi256_ps(cond.data))};
@@ -479,3 +602,16 @@ inline FVec3_8 cross(FVec3_8 a, glm::vec3 b) {
         fms(a.x, FVec8{b.y}, a.y * b.x)
     };
 }
+
+inline FVec3_8 cross(FVec3_8 a, FVec3_8 b) {
+    return {
+        fms(a.y, b.z, a.z * b.y),
+        fms(a.z, b.x, a.x * b.z),
+        fms(a.x, b.y, a.y * b.x)
+    };
+}
+
+
+inline FVec3_8 normalize(FVec3_8 v) {
+    return v / sqrt(dot(v, v));
+}
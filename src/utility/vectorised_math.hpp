@@ -0,0 +1,309 @@
+#pragma once
+
+#include "vectorised.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include <immintrin.h>
+#include <xmmintrin.h>
+
+
+// Vectorised transcendental functions and fast approximations for FVec4 and FVec8.
+// Each function is implemented once as a template over float, FVec4 and FVec8, so the float version (named with a
+// "Reference" suffix) gives exactly the same results as each element of the vectorised versions, for checking them.
+// Error bounds are relative to the exact result, in units of float epsilon (2^-23), unless stated otherwise.
+// Inputs outside the stated domains give unspecified results.
+
+
+// Elementwise primitives for the implementations, with the same behaviour for float, FVec4 and FVec8.
+
+inline float conditional(bool cond, float trueVal, float falseVal) {
+    return cond ? trueVal : falseVal;
+}
+
+
+// 2^n for integer-valued n in [-126, 127].
+inline float exp2Integer(float n) {
+    return std::ldexp(1.0f, static_cast<int>(n));
+}
+
+inline FVec4 exp2Integer(FVec4 n) {
+    auto const exponent = _mm_add_epi32(_mm_cvtps_epi32(n.data), _mm_set1_epi32(127));
+    return FVec4{_mm_castsi128_ps(_mm_slli_epi32(exponent, 23))};
+}
+
+inline FVec8 exp2Integer(FVec8 n) {
+    auto const exponent = _mm256_add_epi32(_mm256_cvtps_epi32(n.data), _mm256_set1_epi32(127));
+    return FVec8{_mm256_castsi256_ps(_mm256_slli_epi32(exponent, 23))};
+}
+
+
+// Splits a positive normal number into mantissa in [0.5, 1) and exponent, as std::frexp().
+inline float splitExponent(float v, float& exponent) {
+    int intExponent = 0;
+    auto const mantissa = std::frexp(v, &intExponent);
+    exponent = static_cast<float>(intExponent);
+    return mantissa;
+}
+
+inline FVec4 splitExponent(FVec4 v, FVec4& exponent) {
+    auto const bits = _mm_castps_si128(v.data);
+    exponent = FVec4{_mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126)))};
+    auto const mantissa = _mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)), _mm_set1_epi32(0x3F000000));
+    return FVec4{_mm_castsi128_ps(mantissa)};
+}
+
+inline FVec8 splitExponent(FVec8 v, FVec8& exponent) {
+    auto const bits = _mm256_castps_si256(v.data);
+    exponent = FVec8{_mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126)))};
+    auto const mantissa = _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)),
+        _mm256_set1_epi32(0x3F000000));
+    return FVec8{_mm256_castsi256_ps(mantissa)};
+}
+
+
+// Hardware approximation of 1/v, with relative error <= 1.5 * 2^-12.
+inline float reciprocalEstimate(float v) {
+    return _mm_cvtss_f32(_mm_rcp_ss(_mm_set_ss(v)));
+}
+
+inline FVec4 reciprocalEstimate(FVec4 v) {
+    return FVec4{_mm_rcp_ps(v.data)};
+}
+
+inline FVec8 reciprocalEstimate(FVec8 v) {
+    return FVec8{_mm256_rcp_ps(v.data)};
+}
+
+
+// Hardware approximation of 1/sqrt(v), with relative error <= 1.5 * 2^-12.
+inline float rsqrtEstimate(float v) {
+    return _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(v)));
+}
+
+inline FVec4 rsqrtEstimate(FVec4 v) {
+    return FVec4{_mm_rsqrt_ps(v.data)};
+}
+
+inline FVec8 rsqrtEstimate(FVec8 v) {
+    return FVec8{_mm256_rsqrt_ps(v.data)};
+}
+
+
+// Implementations. Polynomial approximations are from the Cephes library (S. L. Moshier).
+
+// Computes sin(v) and cos(v).
+template<typename V>
+std::pair<V, V> sinCosImpl(V v) {
+    using std::floor;
+    using std::fma;
+
+    // Reduce to r in [-pi/4, pi/4], v = r + j*pi/2. pi/2 is split into 3 parts, so j*pi/2 is accurate for large j.
+    auto const j = floor(fma(v, V{0.63661977236758134f}, V{0.5f}));
+    auto const r = fma(j, V{-7.54978995489188216e-8f}, fma(j, V{-4.837512969970703125e-4f},
+        fma(j, V{-1.5703125f}, v)));
+    auto const r2 = r * r;
+    auto const sinR = fma(r * r2, fma(fma(V{-1.9515295891e-4f}, r2, V{8.3321608736e-3f}), r2, V{-1.6666654611e-1f}), r);
+    auto const cosR = fma(r2 * r2,
+        fma(fma(V{2.443315711809948e-5f}, r2, V{-1.388731625493765e-3f}), r2, V{4.166664568298827e-2f}),
+        fma(r2, V{-0.5f}, V{1.0f}));
+
+    // Quadrant of v: sin(v), cos(v) = sin(r), cos(r); cos(r), -sin(r); -sin(r), -cos(r); -cos(r), sin(r).
+    auto const quadrant = j - V{4.0f} * floor(j * V{0.25f});
+    auto const upperHalf = floor(quadrant * V{0.5f});
+    auto const odd = quadrant - V{2.0f} * upperHalf;
+    auto const swap = V{0.5f} < odd;
+    auto const sinSign = V{1.0f} - V{2.0f} * upperHalf;
+    auto const cosSign = sinSign * (V{1.0f} - V{2.0f} * odd);
+    return {sinSign * conditional(swap, cosR, sinR), cosSign * conditional(swap, sinR, cosR)};
+}
+
+
+template<typename V>
+V expImpl(V v) {
+    using std::floor;
+    using std::fma;
+    using std::max;
+    using std::min;
+
+    // Clamp so that 2^n below is a normal number.
+    v = min(max(v, V{-87.3365447504f}), V{88.0f});
+    // Reduce to r in [-ln(2)/2, ln(2)/2], v = r + n*ln(2). ln(2) is split into 2 parts, so n*ln(2) is accurate.
+    auto const n = floor(fma(v, V{1.44269504088896341f}, V{0.5f}));
+    auto const r = fma(n, V{2.12194440e-4f}, fma(n, V{-0.693359375f}, v));
+    auto p = V{1.9875691500e-4f};
+    p = fma(p, r, V{1.3981999507e-3f});
+    p = fma(p, r, V{8.3334519073e-3f});
+    p = fma(p, r, V{4.1665795894e-2f});
+    p = fma(p, r, V{1.6666665459e-1f});
+    p = fma(p, r, V{5.0000001201e-1f});
+    p = fma(p, r * r, r + V{1.0f});
+    return p * exp2Integer(n);
+}
+
+
+template<typename V>
+V logImpl(V v) {
+    using std::fma;
+
+    V exponent;
+    auto const mantissa = splitExponent(v, exponent);
+    // Use a mantissa in [sqrt(0.5), sqrt(2)), around which the polynomial is accurate.
+    auto const small = mantissa < V{0.707106781186547524f};
+    exponent = conditional(small, exponent - V{1.0f}, exponent);
+    auto const m = conditional(small, mantissa + mantissa, mantissa) - V{1.0f};
+    auto const m2 = m * m;
+    auto p = V{7.0376836292e-2f};
+    p = fma(p, m, V{-1.1514610310e-1f});
+    p = fma(p, m, V{1.1676998740e-1f});
+    p = fma(p, m, V{-1.2420140846e-1f});
+    p = fma(p, m, V{1.4249322787e-1f});
+    p = fma(p, m, V{-1.6668057665e-1f});
+    p = fma(p, m, V{2.0000714765e-1f});
+    p = fma(p, m, V{-2.4999993993e-1f});
+    p = fma(p, m, V{3.3333331174e-1f});
+    auto y = p * m * m2;
+    y = fma(exponent, V{-2.12194440e-4f}, y);
+    y = fma(m2, V{-0.5f}, y);
+    // ln(2) is split into 2 parts, so exponent*ln(2) is accurate.
+    return fma(exponent, V{0.693359375f}, m + y);
+}
+
+
+template<typename V>
+V powImpl(V base, V exponent) {
+    return expImpl(exponent * logImpl(base));
+}
+
+
+// Refines the estimate with 1 Newton-Raphson iteration.
+template<typename V>
+V reciprocalImpl(V v) {
+    auto const estimate = reciprocalEstimate(v);
+    return estimate * (V{2.0f} - v * estimate);
+}
+
+
+// Refines the estimate with 1 Newton-Raphson iteration.
+template<typename V>
+V rsqrtImpl(V v) {
+    auto const estimate = rsqrtEstimate(v);
+    return estimate * (V{1.5f} - V{0.5f} * v * estimate * estimate);
+}
+
+
+// Public functions.
+
+// sin(v) and cos(v) for |v| <= 8192, with absolute error <= 2^-23.
+inline std::pair<float, float> sinCosReference(float v) {
+    return sinCosImpl(v);
+}
+
+inline std::pair<FVec4, FVec4> sinCos(FVec4 v) {
+    return sinCosImpl(v);
+}
+
+inline std::pair<FVec8, FVec8> sinCos(FVec8 v) {
+    return sinCosImpl(v);
+}
+
+
+inline float sinReference(float v) {
+    return sinCosImpl(v).first;
+}
+
+inline FVec4 sin(FVec4 v) {
+    return sinCosImpl(v).first;
+}
+
+inline FVec8 sin(FVec8 v) {
+    return sinCosImpl(v).first;
+}
+
+
+inline float cosReference(float v) {
+    return sinCosImpl(v).second;
+}
+
+inline FVec4 cos(FVec4 v) {
+    return sinCosImpl(v).second;
+}
+
+inline FVec8 cos(FVec8 v) {
+    return sinCosImpl(v).second;
+}
+
+
+// e^v, with error <= 2 epsilon. Results are clamped to [e^-87.34, e^88].
+inline float expReference(float v) {
+    return expImpl(v);
+}
+
+inline FVec4 exp(FVec4 v) {
+    return expImpl(v);
+}
+
+inline FVec8 exp(FVec8 v) {
+    return expImpl(v);
+}
+
+
+// Natural logarithm of v, for positive normal v, with absolute error <= 2^-23 for v in [0.5, 2], else relative
+// error <= 1 epsilon.
+inline float logReference(float v) {
+    return logImpl(v);
+}
+
+inline FVec4 log(FVec4 v) {
+    return logImpl(v);
+}
+
+inline FVec8 log(FVec8 v) {
+    return logImpl(v);
+}
+
+
+// base^exponent, for positive normal base, computed as e^(exponent * ln(base)). The error of ln(base) is magnified
+// by the exponent, so the error is <= 2 epsilon + |exponent * ln(base)| * 2^-23.
+inline float powReference(float base, float exponent) {
+    return powImpl(base, exponent);
+}
+
+inline FVec4 pow(FVec4 base, FVec4 exponent) {
+    return powImpl(base, exponent);
+}
+
+inline FVec8 pow(FVec8 base, FVec8 exponent) {
+    return powImpl(base, exponent);
+}
+
+
+// 1/v, for normal v with |v| < 2^126, with error <= 2 epsilon. Faster than division.
+// For larger |v| the result is subnormal, and the hardware estimate gives 0.
+inline float reciprocalReference(float v) {
+    return reciprocalImpl(v);
+}
+
+inline FVec4 reciprocal(FVec4 v) {
+    return reciprocalImpl(v);
+}
+
+inline FVec8 reciprocal(FVec8 v) {
+    return reciprocalImpl(v);
+}
+
+
+// 1/sqrt(v), for positive normal v, with error <= 3 epsilon. Faster than square root and division.
+inline float rsqrtReference(float v) {
+    return rsqrtImpl(v);
+}
+
+inline FVec4 rsqrt(FVec4 v) {
+    return rsqrtImpl(v);
+}
+
+inline FVec8 rsqrt(FVec8 v) {
+    return rsqrtImpl(v);
+}
@@ -0,0 +1,531 @@
+#pragma once
+
+#include "bvh_build.hpp"
+#include "geometry.hpp"
+#include "model_tree.hpp"
+#include "render.hpp"
+#include "utility/math.hpp"
+#include "utility/radix_sort.hpp"
+#include "utility/random.hpp"
+#include "utility/span.hpp"
+#include "utility/tile_scheduler.hpp"
+#include "utility/vectorised.hpp"
+#include "utility/vectorised_math.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+
+
+// Path tracing engine used for rendering. The engine is chosen at runtime.
+enum class RenderEngine : std::uint8_t {
+    MEGAKERNEL,         // Each path is traced from start to end by rayTrace().
+    WAVEFRONT,          // Batches of paths are traced one bounce at a time by WavefrontTracer.
+    WAVEFRONT_SORTED    // WAVEFRONT with rays sorted for coherence before each bounce.
+};
+
+
+constexpr inline std::array<std::pair<RenderEngine, char const*>, 3> RENDER_ENGINE_NAMES{{
+    {RenderEngine::MEGAKERNEL, "megakernel"},
+    {RenderEngine::WAVEFRONT, "wavefront"},
+    {RenderEngine::WAVEFRONT_SORTED, "wavefront-sorted"}
+}};
+
+
+inline std::optional<RenderEngine> parseRenderEngine(char const* name) {
+    for (auto const& [engine, engineName] : RENDER_ENGINE_NAMES) {
+        if (std::strcmp(name, engineName) == 0) {
+            return engine;
+        }
+    }
+    return std::nullopt;
+}
+
+
+// Performs backwards path tracing on a batch of paths together, one bounce at a time. Each bounce is split into
+// stages (intersection, shading, shadow rays, compaction) which run over the whole batch, so each stage's code and
+// data stay in cache, the intersection stage can trace rays together, and the shading stage can shade independent
+// paths together in SIMD lanes.
+// Computes the same estimate as rayTrace(), but accumulates light along a path as it goes, rather than all at once
+// at the end, as only the current bounce of each path is kept.
+// Optionally, rays after the first bounce are sorted before intersection, so that consecutive rays start near each
+// other and head in similar directions, and so tend to visit the same nodes of the acceleration structures.
+class WavefrontTracer {
+public:
+    explicit WavefrontTracer(bool sortRays = false) :
+        _sortRays{sortRays}
+    {}
+
+    // Removes all paths.
+    void clear() {
+        _paths.resize(0);
+    }
+
+    // Adds a path starting with a camera ray. All camera rays must have the same origin. pixel identifies the sample
+    // buffer element which receives the path's light.
+    void addCameraRay(Line const& ray, std::uint32_t pixel) {
+        assert(_paths.size() == 0 || _paths.origins[0] == ray.origin);
+        auto const index = _paths.size();
+        _paths.resize(index + 1);
+        _paths.origins[index] = ray.origin;
+        _paths.directions[index] = ray.direction;
+        _paths.throughputs[index] = glm::vec3{1.0f};
+        _paths.radiances[index] = glm::vec3{0.0f};
+        _paths.brdfPdfs[index] = 0.0f;
+        _paths.pixels[index] = pixel;
+    }
+
+    // Traces all paths to completion, adding the light of each path to its pixel's samples (not including the sample
+    // count). Camera rays which are added together for the same pixel should be added consecutively, for coherence.
+    void trace(RayTraceData const& data, Span<AccumulationBuffer::Samples> samples, FastRNG& randomEngine) {
+        for (unsigned depth = 0; _paths.size() > 0; ++depth) {
+            if (depth == 0) {
+                _intersectCameraRays(data);
+            }
+            else {
+                if (_sortRays) {
+                    _sort();
+                }
+                _intersectRays(data);
+            }
+            _shade(data, depth, randomEngine);
+            _traceShadowRays(data);
+            _compact(samples);
+        }
+    }
+
+private:
+    // Paths being traced, in structure of arrays layout so each stage only touches the data it needs.
+    // All paths are at the same depth.
+    struct PathQueue {
+        std::vector<glm::vec3> origins;         // Ray of the path's current bounce.
+        std::vector<glm::vec3> directions;
+        std::vector<glm::vec3> throughputs;     // Fraction of light arriving along the ray which reaches the camera.
+        std::vector<glm::vec3> radiances;       // Light reaching the camera gathered so far.
+        std::vector<float> brdfPdfs;            // Solid angle density of having sampled the ray from the BRDF.
+        std::vector<std::uint32_t> pixels;
+        std::vector<std::optional<LineMeshIntersection>> intersections;     // Nearest intersection of the ray.
+        std::vector<std::uint8_t> terminated;   // Nonzero once the path has ended.
+
+        std::size_t size() const {
+            return origins.size();
+        }
+
+        void resize(std::size_t size) {
+            origins.resize(size);
+            directions.resize(size);
+            throughputs.resize(size);
+            radiances.resize(size);
+            brdfPdfs.resize(size);
+            pixels.resize(size);
+            intersections.resize(size);
+            terminated.resize(size);
+        }
+
+        void move(std::size_t from, std::size_t to) {
+            copy(*this, from, to);
+        }
+
+        // Copies a path (not including its intersection) from another queue.
+        void copy(PathQueue const& source, std::size_t from, std::size_t to) {
+            origins[to] = source.origins[from];
+            directions[to] = source.directions[from];
+            throughputs[to] = source.throughputs[from];
+            radiances[to] = source.radiances[from];
+            brdfPdfs[to] = source.brdfPdfs[from];
+            pixels[to] = source.pixels[from];
+        }
+    };
+
+    struct SortReference {
+        std::uint32_t key;
+        std::uint32_t path;
+    };
+
+    // Rays from path vertices to points sampled on light sources, which add light to their path if unoccluded.
+    struct ShadowRayQueue {
+        std::vector<glm::vec3> origins;
+        std::vector<glm::vec3> directions;
+        std::vector<float> tMaxs;
+        std::vector<glm::vec3> lights;          // Light reaching the camera if the ray is unoccluded.
+        std::vector<std::uint32_t> paths;
+
+        void clear() {
+            origins.clear();
+            directions.clear();
+            tMaxs.clear();
+            lights.clear();
+            paths.clear();
+        }
+
+        void push(Line const& ray, float tMax, glm::vec3 light, std::uint32_t path) {
+            origins.push_back(ray.origin);
+            directions.push_back(ray.direction);
+            tMaxs.push_back(tMax);
+            lights.push_back(light);
+            paths.push_back(path);
+        }
+    };
+
+    bool _sortRays;
+    PathQueue _paths;
+    PathQueue _sortedPaths;         // Scratch space for sorting.
+    std::vector<SortReference> _sortReferences;
+    std::vector<SortReference> _sortScratch;    // Scratch space for sorting the references.
+    ShadowRayQueue _shadowRays;
+
+    // Camera rays share an origin, so they are intersected in packets. The last packet is padded with copies of its
+    // first ray, whose results are discarded.
+    void _intersectCameraRays(RayTraceData const& data) {
+        auto const pathCount = _paths.size();
+        for (std::size_t i = 0; i < pathCount; i += LINE_PACKET_SIZE) {
+            auto const packetSize = static_cast<unsigned>(std::min<std::size_t>(pathCount - i, LINE_PACKET_SIZE));
+            LinePacket rays{_paths.origins[i], FVec3_8::zero()};
+            for (unsigned j = 0; j < LINE_PACKET_SIZE; ++j) {
+                rays.directions.insert(j, _paths.directions[i + (j < packetSize ? j : 0)]);
+            }
+            auto const intersections = data.modelTree.lineTriNearestIntersections<SurfaceConsideration::FRONT_ONLY>(
+                rays, RAY_INTERSECTION_T_MIN);
+            std::copy_n(intersections.cbegin(), packetSize, _paths.intersections.begin() + i);
+        }
+    }
+
+    // Sorts paths by the octant of their ray direction, then by the Morton code of their ray origin within the bounds
+    // of all origins.
+    void _sort() {
+        constexpr unsigned MORTON_BITS = 29;
+        auto const bounds = computeBoundingBox(readOnlySpan(_paths.origins));
+        _sortReferences.resize(_paths.size());
+        for (std::size_t i = 0; i < _paths.size(); ++i) {
+            auto const& direction = _paths.directions[i];
+            auto const octant = (direction.x < 0.0f ? 4u : 0u) | (direction.y < 0.0f ? 2u : 0u)
+                | (direction.z < 0.0f ? 1u : 0u);
+            auto const morton = static_cast<std::uint32_t>(mortonCode(_paths.origins[i], bounds) >> (63 - MORTON_BITS));
+            _sortReferences[i] = {(octant << MORTON_BITS) | morton, static_cast<std::uint32_t>(i)};
+        }
+        radixSort(_sortReferences, _sortScratch, [](SortReference const& reference) { return reference.key; });
+        _sortedPaths.resize(_paths.size());
+        for (std::size_t i = 0; i < _paths.size(); ++i) {
+            _sortedPaths.copy(_paths, _sortReferences[i].path, i);
+        }
+        std::swap(_paths, _sortedPaths);
+    }
+
+    void _intersectRays(RayTraceData const& data) {
+        for (std::size_t i = 0; i < _paths.size(); ++i) {
+            _paths.intersections[i] = data.modelTree.lineTriNearestIntersection<SurfaceConsideration::FRONT_ONLY>(
+                {_paths.origins[i], _paths.directions[i]}, RAY_INTERSECTION_T_MIN);
+        }
+    }
+
+    // Gathers emitted light at each path's intersection, queues a shadow ray for next event estimation, and samples
+    // the path's next ray from the BRDF. Terminates paths which miss the scene or reach the bounce limit.
+    // Paths are shaded 8 at a time, one per FVec8 lane.
+    void _shade(RayTraceData const& data, unsigned depth, FastRNG& randomEngine) {
+        _shadowRays.clear();
+        for (std::size_t first = 0; first < _paths.size(); first += SHADE_LANES) {
+            auto const laneCount = static_cast<unsigned>(std::min<std::size_t>(_paths.size() - first, SHADE_LANES));
+            _shadeLanes(data, depth, first, laneCount, randomEngine);
+        }
+    }
+
+    constexpr inline static unsigned SHADE_LANES = 8;
+
+    // Shades paths [first, first + laneCount). Per-path data is gathered into lanes, the shading is computed for all
+    // lanes at once, then the results are scattered back. Lanes without a path or intersection are inactive, and their
+    // results are discarded.
+    void _shadeLanes(RayTraceData const& data, unsigned depth, std::size_t first, unsigned laneCount,
+            FastRNG& randomEngine) {
+        auto const zero = FVec8::zero();
+        FVec8 ts = zero;
+        FVec3_8 points{zero};
+        FVec3_8 directions{zero};
+        FVec3_8 throughputs{zero};
+        FVec8 brdfPdfs = zero;
+        FVec8 ndfAlphaSqs = zero;
+        FVec8 geometryAlphaSqs = zero;
+        FVec3_8 f0s{zero};
+        FVec3_8 adjustedColours{zero};
+        FVec3_8 emissions{zero};
+        FVec3_8 hitLightNormals{zero};       // Normal of the intersected tri if it's a light source.
+        FVec3_8 vertexNormals1{zero};
+        FVec3_8 vertexNormals2{zero};
+        FVec3_8 vertexNormals3{zero};
+        FVec8 pointCoords2 = zero;
+        FVec8 pointCoords3 = zero;
+        std::array<FVec3_8, 3> normalTransforms{FVec3_8{zero}, FVec3_8{zero}, FVec3_8{zero}};   // Columns.
+        FVec3_8 lightPoints{zero};
+        FVec3_8 lightNormals{zero};
+        FVec3_8 lightEmissions{zero};
+        FVec8 thetaParams = zero;
+        FVec8 phis = zero;
+        unsigned active = 0;
+        unsigned hitLights = 0;
+        unsigned lightSampled = 0;
+        for (unsigned lane = 0; lane < laneCount; ++lane) {
+            auto const path = first + lane;
+            auto const& intersection = _paths.intersections[path];
+            if (!intersection) {
+                _paths.terminated[path] = true;
+                continue;
+            }
+            active |= 1u << lane;
+            ts[lane] = intersection->t;
+            points.insert(lane, intersection->point);
+            directions.insert(lane, _paths.directions[path]);
+            throughputs.insert(lane, _paths.throughputs[path]);
+            brdfPdfs[lane] = _paths.brdfPdfs[path];
+
+            auto const model = intersection->meshTriIndex.mesh;
+            auto const& material = data.materials[model];
+            ndfAlphaSqs[lane] = material.ndfAlphaSq;
+            geometryAlphaSqs[lane] = material.geometryAlphaSq;
+            f0s.insert(lane, material.f0);
+            adjustedColours.insert(lane, material.adjustedColour);
+            emissions.insert(lane, material.emission.toGLMVec3());
+            if (auto const lightNormal = data.lights.normal(intersection->meshTriIndex)) {
+                hitLights |= 1u << lane;
+                hitLightNormals.insert(lane, *lightNormal);
+            }
+
+            auto const vertexNormals = data.vertexNormals[data.vertexRanges[model]];
+            auto const& tri = data.tris[data.triRanges[model]][intersection->meshTriIndex.tri];
+            vertexNormals1.insert(lane, vertexNormals[tri.v1]);
+            vertexNormals2.insert(lane, vertexNormals[tri.v2]);
+            vertexNormals3.insert(lane, vertexNormals[tri.v3]);
+            pointCoords2[lane] = intersection->pointCoord2;
+            pointCoords3[lane] = intersection->pointCoord3;
+            auto const& normalTransform = data.modelTree.normalTransform(model);
+            for (unsigned column = 0; column < 3; ++column) {
+                normalTransforms[column].insert(lane, normalTransform[column]);
+            }
+
+            if (auto const lightSample = data.lights.sample(randomEngine)) {
+                lightSampled |= 1u << lane;
+                lightPoints.insert(lane, lightSample->point);
+                lightNormals.insert(lane, lightSample->normal);
+                lightEmissions.insert(lane, lightSample->emission.toGLMVec3());
+            }
+            thetaParams[lane] = randomEngine.unitFloatOpen();
+            phis[lane] = randomEngine.angle();
+        }
+        if (active == 0) {
+            return;
+        }
+
+        // Emission, weighted against next event estimation at the previous bounce.
+        auto emissionWeights = FVec8{1.0f};
+        if (depth > 0) {
+            auto const lightCos = -dot(hitLightNormals, directions);
+            auto const lightPdfs = data.lights.areaPdf() * square(ts) / lightCos;
+            auto const brdfPdfSqs = square(brdfPdfs);
+            emissionWeights = conditional(unpackBitmask(hitLights) & (lightPdfs > 0.0f),
+                brdfPdfSqs / (brdfPdfSqs + square(lightPdfs)), emissionWeights);
+        }
+        auto const emitted = throughputs * emissions * emissionWeights;
+        for (unsigned lane = 0; lane < laneCount; ++lane) {
+            if (active & (1u << lane)) {
+                _paths.radiances[first + lane] += emitted.extract(lane);
+            }
+        }
+
+        if (depth >= RAY_BOUNCE_LIMIT) {
+            for (unsigned lane = 0; lane < laneCount; ++lane) {
+                _paths.terminated[first + lane] = true;
+            }
+            return;
+        }
+
+        auto const pointCoords1 = 1.0f - pointCoords2 - pointCoords3;
+        auto const objectNormals = fma(vertexNormals3, FVec3_8{pointCoords3},
+            fma(vertexNormals2, FVec3_8{pointCoords2}, vertexNormals1 * pointCoords1));
+        auto normals = normalize(fma(normalTransforms[2], FVec3_8{objectNormals.z},
+            fma(normalTransforms[1], FVec3_8{objectNormals.y}, normalTransforms[0] * objectNormals.x)));
+        auto const outgoing = -directions;
+        auto nDotOs = dot(normals, outgoing);
+        // Flip normal direction if ray strikes back of surface.
+        auto const backFacing = nDotOs < zero;
+        normals = conditional(backFacing, -normals, normals);
+        nDotOs = abs(nDotOs);
+
+        // Next event estimation.
+        {
+            auto const toLights = lightPoints - points;
+            auto const distanceSqs = dot(toLights, toLights);
+            auto const distances = sqrt(distanceSqs);
+            auto const lightDirections = toLights / distances;
+            auto const nDotLs = dot(normals, lightDirections);
+            auto const lightCos = -dot(lightNormals, lightDirections);
+            auto const visible = bitmask((nDotLs > 0.0f) & (lightCos > 0.0f)) & lightSampled & active;
+            if (visible != 0) {
+                auto const lightHalfways = normalize(outgoing + lightDirections);
+                auto const lightNDotHs = dot(normals, lightHalfways);
+                auto const lightHDotOs = dot(lightHalfways, outgoing);
+                auto const lightPdfs = data.lights.areaPdf() * distanceSqs / lightCos;
+                auto const specularFs = fresnelSchlick(f0s, lightHDotOs);
+                auto const specularDs = ggxNDF(ndfAlphaSqs, lightNDotHs);
+                auto const specularGs = ggxGeometry(geometryAlphaSqs, nDotLs, nDotOs, lightHDotOs, lightHDotOs);
+                auto const lightBRDFPdfs = specularDs * lightNDotHs / (4.0f * lightHDotOs);
+                auto const misWeights = square(lightPdfs) / (square(lightPdfs) + square(lightBRDFPdfs));
+                auto const diffuses = fnma(specularFs, adjustedColours, adjustedColours) * nDotLs;
+                auto const speculars = specularFs * (specularGs * specularDs / (4.0f * nDotOs));
+                auto const lights = throughputs * (diffuses + speculars) * lightEmissions * (misWeights / lightPdfs);
+                for (unsigned lane = 0; lane < laneCount; ++lane) {
+                    if (visible & (1u << lane)) {
+                        // Exclude the light's own tri at the end of the shadow ray.
+                        _shadowRays.push({points.extract(lane), lightDirections.extract(lane)},
+                            distances[lane] - RAY_INTERSECTION_T_MIN, lights.extract(lane),
+                            static_cast<std::uint32_t>(first + lane));
+                    }
+                }
+            }
+        }
+
+        auto const [perpendiculars1, perpendiculars2] = orthonormalBasis(normals);
+
+        // Sample incident rays according to GGX distribution.
+        auto const cosThetaSqs = 1.0f / (1.0f + ndfAlphaSqs * thetaParams / (1.0f - thetaParams));
+        auto const cosThetas = sqrt(cosThetaSqs);
+        auto const sinThetas = sqrt(1.0f - cosThetaSqs);
+        auto const [sinPhis, cosPhis] = sinCos(phis);
+        auto const halfways = fma(normals, FVec3_8{cosThetas},
+            fma(perpendiculars1, FVec3_8{cosPhis}, perpendiculars2 * sinPhis) * sinThetas);
+        auto const hDotOs = dot(halfways, outgoing);
+        auto const incidents = halfways * (2.0f * hDotOs) - outgoing;
+        auto const nDotIs = dot(normals, incidents);
+        // Paths with nDotI <= 0 end, as the weight of incident light becomes 0.
+        auto const continuing = bitmask(nDotIs > 0.0f) & active;
+
+        // Cook-Torrance BRDF.
+        // ray probability = specularD * nDotH / (4 * hDotO)
+        auto const specularFs = fresnelSchlick(f0s, hDotOs);
+        auto const specularDs = ggxNDF(ndfAlphaSqs, cosThetas);
+        auto const specularGs = ggxGeometry(geometryAlphaSqs, nDotIs, nDotOs, hDotOs, hDotOs);
+        auto const diffuses = fnma(specularFs, adjustedColours, adjustedColours)
+            * (4.0f * nDotIs * hDotOs / (specularDs * cosThetas));
+        auto const speculars = specularFs * (specularGs * hDotOs / (nDotOs * cosThetas));
+        auto const weights = diffuses + conditional(nDotOs > 0.0f, speculars, FVec3_8::zero());
+        auto const newThroughputs = throughputs * weights;
+        auto const newBRDFPdfs = specularDs * cosThetas / (4.0f * hDotOs);
+        for (unsigned lane = 0; lane < laneCount; ++lane) {
+            auto const path = first + lane;
+            if (continuing & (1u << lane)) {
+                _paths.terminated[path] = false;
+                _paths.throughputs[path] = newThroughputs.extract(lane);
+                _paths.brdfPdfs[path] = newBRDFPdfs[lane];
+                _paths.origins[path] = points.extract(lane);
+                _paths.directions[path] = incidents.extract(lane);
+            }
+            else {
+                _paths.terminated[path] = true;
+            }
+        }
+    }
+
+    void _traceShadowRays(RayTraceData const& data) {
+        for (std::size_t i = 0; i < _shadowRays.paths.size(); ++i) {
+            auto const occluded = data.modelTree.occluded<SurfaceConsideration::FRONT_ONLY>(
+                {_shadowRays.origins[i], _shadowRays.directions[i]}, RAY_INTERSECTION_T_MIN, _shadowRays.tMaxs[i]);
+            if (!occluded) {
+                _paths.radiances[_shadowRays.paths[i]] += _shadowRays.lights[i];
+            }
+        }
+    }
+
+    // Outputs the light of terminated paths and removes them, keeping the remaining paths in order.
+    void _compact(Span<AccumulationBuffer::Samples> samples) {
+        std::size_t liveCount = 0;
+        for (std::size_t i = 0; i < _paths.size(); ++i) {
+            if (_paths.terminated[i]) {
+                auto const& radiance = _paths.radiances[i];
+                auto& pixelSamples = samples[_paths.pixels[i]];
+                pixelSamples.sum += radiance;
+                pixelSamples.luminanceSquareSum += square(static_cast<double>(luminance(radiance)));
+            }
+            else {
+                if (liveCount != i) {
+                    _paths.move(i, liveCount);
+                }
+                ++liveCount;
+            }
+        }
+        _paths.resize(liveCount);
+    }
+};
+
+
+// Same as renderPass(), but traces the samples of each tile together with WavefrontTracer.
+inline std::size_t renderPassWavefront(RenderData const& data, AccumulationBuffer& accumulation,
+        unsigned samplesPerPixel, float errorThreshold, TileScheduler& scheduler, bool sortRays = false) {
+    assert(accumulation.width() == data.imageWidth && accumulation.height() == data.imageHeight);
+    std::vector<WavefrontTracer> tracers(scheduler.threadCount(), WavefrontTracer{sortRays});
+    std::vector<std::vector<AccumulationBuffer::Samples>> tileBuffers(scheduler.threadCount());
+    std::atomic<std::size_t> sampledPixels{0};
+    scheduler.run([&data, &accumulation, samplesPerPixel, errorThreshold, &tracers, &tileBuffers, &sampledPixels]
+            (Tile const& tile, unsigned threadIndex) {
+        auto& randomEngine = ::randomEngine;    // Access random engine here to force static initialisation.
+        auto& tracer = tracers[threadIndex];
+        auto& tileBuffer = tileBuffers[threadIndex];
+        tileBuffer.resize(tile.width * tile.height);
+        tracer.clear();
+        std::size_t tileSampledPixels = 0;
+        for (unsigned y = 0; y < tile.height; ++y) {
+            for (unsigned x = 0; x < tile.width; ++x) {
+                auto const pixelX = tile.x + x;
+                auto const pixelY = tile.y + y;
+                auto const tilePixel = y * tile.width + x;
+                auto& samples = tileBuffer[tilePixel];
+                samples = {glm::vec3{0.0f}, 0.0, 0};
+                if (!accumulation.needsSamples(static_cast<std::size_t>(pixelY) * data.imageWidth + pixelX,
+                        errorThreshold)) {
+                    continue;
+                }
+                for (unsigned i = 0; i < samplesPerPixel; ++i) {
+                    auto const sampleX = pixelX + randomEngine.unitFloatOpen();
+                    auto const sampleY = pixelY + randomEngine.unitFloatOpen();
+                    auto const rayDirection =
+                        glm::normalize(data.pixelToRayTransform * glm::vec3{sampleX, sampleY, 1.0f});
+                    tracer.addCameraRay({data.cameraPosition, rayDirection}, tilePixel);
+                }
+                samples.count = samplesPerPixel;
+                ++tileSampledPixels;
+            }
+        }
+        tracer.trace(data.rayTraceData, Span{tileBuffer}, randomEngine);
+        for (unsigned y = 0; y < tile.height; ++y) {
+            for (unsigned x = 0; x < tile.width; ++x) {
+                auto const pixel = static_cast<std::size_t>(tile.y + y) * data.imageWidth + tile.x + x;
+                accumulation.add(pixel, tileBuffer[y * tile.width + x]);
+            }
+        }
+        sampledPixels.fetch_add(tileSampledPixels, std::memory_order_relaxed);
+    });
+    return sampledPixels.load();
+}
+
+
+// Renders one progressive pass with the given engine. See renderPass().
+inline std::size_t renderPass(RenderEngine engine, RenderData const& data, AccumulationBuffer& accumulation,
+        unsigned samplesPerPixel, float errorThreshold = PIXEL_ERROR_THRESHOLD) {
+    TileScheduler scheduler{data.imageWidth, data.imageHeight, RENDER_TILE_SIZE};
+    switch (engine) {
+    case RenderEngine::WAVEFRONT:
+        return renderPassWavefront(data, accumulation, samplesPerPixel, errorThreshold, scheduler);
+    case RenderEngine::WAVEFRONT_SORTED:
+        return renderPassWavefront(data, accumulation, samplesPerPixel, errorThreshold, scheduler, true);
+    case RenderEngine::MEGAKERNEL:
+    default:
+        return renderPass(data, accumulation, samplesPerPixel, errorThreshold, scheduler);
+    }
+}
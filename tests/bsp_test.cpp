@@ -0,0 +1,77 @@
+#include "bsp.hpp"
+#include "geometry.hpp"
+#include "index_types.hpp"
+#include "mesh.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+
+static bool check(bool condition, char const* description) {
+    if (!condition) {
+        std::cerr << "FAILED: " << description << std::endl;
+    }
+    return condition;
+}
+
+
+// Builds a tree of copies of one tri, which can't be divided between leaves, and checks a line hits it.
+static bool testCoincidentTris(unsigned triCount) {
+    std::vector<glm::vec3> const vertexPositions{{0.0f, 0.0f, 0.0f}, {1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}};
+    std::vector<IndexedTri> const tris(triCount, IndexedTri{0, 1, 2});
+    std::vector<PreprocessedTri> const preprocessedTris(triCount,
+        preprocessTri({vertexPositions[0], vertexPositions[1], vertexPositions[2]}));
+    BSPTree const tree{readOnlySpan(vertexPositions), readOnlySpan(tris), readOnlySpan(preprocessedTris)};
+
+    Line const line{{0.25f, 0.25f, 1.0f}, {0.0f, 0.0f, -1.0f}};
+    auto const intersection = tree.lineTriNearestIntersection<SurfaceConsideration::ALL>(line, 0.0f, INFINITY);
+    auto passed = check(intersection.has_value(), "line intersects coincident tris");
+    if (intersection) {
+        passed &= check(intersection->tri < triCount, "intersected tri index is valid");
+    }
+    passed &= check(tree.occluded<SurfaceConsideration::ALL>(line, 0.0f, INFINITY), "line is occluded");
+    return passed;
+}
+
+
+// Builds a tree of many copies of one tri plus a tri elsewhere, so divisions can separate some of the tris.
+static bool testCoincidentTrisWithOther(unsigned triCount) {
+    std::vector<glm::vec3> const vertexPositions{
+        {0.0f, 0.0f, 0.0f}, {1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f},
+        {2.0f, 0.0f, 0.0f}, {3.0f, 0.0f, 0.0f}, {2.0f, 1.0f, 0.0f}
+    };
+    std::vector<IndexedTri> tris(triCount, IndexedTri{0, 1, 2});
+    tris.push_back({3, 4, 5});
+    std::vector<PreprocessedTri> preprocessedTris;
+    for (auto const& tri : tris) {
+        preprocessedTris.push_back(preprocessTri({vertexPositions[tri.v1], vertexPositions[tri.v2],
+            vertexPositions[tri.v3]}));
+    }
+    BSPTree const tree{readOnlySpan(vertexPositions), readOnlySpan(tris), readOnlySpan(preprocessedTris)};
+
+    Line const line{{2.25f, 0.25f, 1.0f}, {0.0f, 0.0f, -1.0f}};
+    auto const intersection = tree.lineTriNearestIntersection<SurfaceConsideration::ALL>(line, 0.0f, INFINITY);
+    auto passed = check(intersection.has_value(), "line intersects separate tri");
+    if (intersection) {
+        passed &= check(intersection->tri == triCount, "separate tri is intersected");
+    }
+    return passed;
+}
+
+
+int main() {
+    // More coincident tris than fit in a leaf used to be duplicated into both children of every division down to the
+    // maximum depth, exhausting memory.
+    auto passed = testCoincidentTris(32);
+    passed &= testCoincidentTris(33);
+    passed &= testCoincidentTris(3000);
+    passed &= testCoincidentTrisWithOther(3000);
+    if (passed) {
+        std::cout << "All tests passed" << std::endl;
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
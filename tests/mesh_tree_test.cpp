@@ -0,0 +1,285 @@
+#include "geometry.hpp"
+#include "index_types.hpp"
+#include "leaf_tris.hpp"
+#include "mesh.hpp"
+#include "mesh_tree.hpp"
+#include "utility/span.hpp"
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+
+static bool check(bool condition, std::string const& description) {
+    if (!condition) {
+        std::cerr << "FAILED: " << description << std::endl;
+    }
+    return condition;
+}
+
+
+struct TestMesh {
+    std::vector<glm::vec3> vertexPositions;
+    std::vector<IndexedTri> tris;
+    std::vector<PreprocessedTri> preprocessedTris;
+    std::vector<LeafTriBlock> triBlocks;    // All tris, for brute force intersection.
+
+    void addTri(glm::vec3 v1, glm::vec3 v2, glm::vec3 v3) {
+        auto const vertex = static_cast<VertexIndex>(vertexPositions.size());
+        vertexPositions.insert(vertexPositions.end(), {v1, v2, v3});
+        tris.push_back({vertex, vertex + 1, vertex + 2});
+    }
+
+    void preprocess() {
+        preprocessedTris.clear();
+        for (auto const& tri : tris) {
+            preprocessedTris.push_back(preprocessTri({vertexPositions[tri.v1], vertexPositions[tri.v2],
+                vertexPositions[tri.v3]}));
+        }
+        std::vector<TriIndex> allTris(tris.size());
+        for (std::size_t i = 0; i < allTris.size(); ++i) {
+            allTris[i] = static_cast<TriIndex>(i);
+        }
+        triBlocks.clear();
+        appendLeafTriBlocks(readOnlySpan(preprocessedTris), allTris, triBlocks);
+    }
+
+    MeshTree tree(MeshTreeType type) const {
+        return MeshTree{type, readOnlySpan(vertexPositions), readOnlySpan(tris), readOnlySpan(preprocessedTris)};
+    }
+
+    std::optional<LineTriIntersection> nearestIntersection(Line const& line, float tMin) const {
+        std::optional<LineTriIntersection> nearest;
+        leafNearestIntersection<SurfaceConsideration::ALL>(line, triBlocks.data(),
+            static_cast<std::uint32_t>(tris.size()), tMin, INFINITY, nearest);
+        return nearest;
+    }
+
+    bool occluded(Line const& line, float tMin, float tMax) const {
+        return leafOccluded<SurfaceConsideration::ALL>(line, triBlocks.data(), static_cast<std::uint32_t>(tris.size()),
+            tMin, tMax);
+    }
+};
+
+
+// Whether two nearest intersections agree. Different tris may be hit at the same parameter, so only that's compared.
+static bool sameIntersection(std::optional<LineTriIntersection> const& a, std::optional<LineTriIntersection> const& b) {
+    return a.has_value() == b.has_value() && (!a || a->t == b->t);
+}
+
+
+// Axis-aligned unit squares on every integer plane of a cube. Lines along the grid lie in the planes of box faces.
+static TestMesh gridMesh(unsigned size) {
+    TestMesh mesh;
+    for (unsigned axis = 0; axis < 3; ++axis) {
+        auto const u = (axis + 1) % 3;
+        auto const v = (axis + 2) % 3;
+        for (unsigned plane = 0; plane <= size; ++plane) {
+            for (unsigned i = 0; i < size; ++i) {
+                for (unsigned j = 0; j < size; ++j) {
+                    std::array<glm::vec3, 4> corners;
+                    for (unsigned corner = 0; corner < 4; ++corner) {
+                        corners[corner][axis] = static_cast<float>(plane);
+                        corners[corner][u] = static_cast<float>(i + corner % 2);
+                        corners[corner][v] = static_cast<float>(j + corner / 2);
+                    }
+                    mesh.addTri(corners[0], corners[1], corners[3]);
+                    mesh.addTri(corners[0], corners[3], corners[2]);
+                }
+            }
+        }
+    }
+    mesh.preprocess();
+    return mesh;
+}
+
+
+// Axis-aligned directions, with every combination of signed zero components.
+static std::vector<glm::vec3> axisDirections() {
+    std::vector<glm::vec3> directions;
+    for (unsigned axis = 0; axis < 3; ++axis) {
+        for (auto const sign : {1.0f, -1.0f}) {
+            for (auto const zero1 : {0.0f, -0.0f}) {
+                for (auto const zero2 : {0.0f, -0.0f}) {
+                    glm::vec3 direction;
+                    direction[axis] = sign;
+                    direction[(axis + 1) % 3] = zero1;
+                    direction[(axis + 2) % 3] = zero2;
+                    directions.push_back(direction);
+                }
+            }
+        }
+    }
+    return directions;
+}
+
+
+// Random tris with vertices within a radius of centres in the cube [-1, 1]^3.
+static TestMesh randomMesh(std::mt19937& random, std::size_t triCount, float radius) {
+    std::uniform_real_distribution<float> unit{-1.0f, 1.0f};
+    TestMesh mesh;
+    for (std::size_t i = 0; i < triCount; ++i) {
+        glm::vec3 const centre{unit(random), unit(random), unit(random)};
+        std::array<glm::vec3, 3> vertices;
+        for (auto& vertex : vertices) {
+            vertex = centre + radius * glm::vec3{unit(random), unit(random), unit(random)};
+        }
+        mesh.addTri(vertices[0], vertices[1], vertices[2]);
+    }
+    mesh.preprocess();
+    return mesh;
+}
+
+
+// Packets of lines from random points around the cube [-1, 1]^3, heading roughly towards it.
+static std::vector<LinePacket> randomLinePackets(std::mt19937& random, std::size_t packetCount) {
+    std::uniform_real_distribution<float> unit{-1.0f, 1.0f};
+    std::vector<LinePacket> packets;
+    for (std::size_t i = 0; i < packetCount; ++i) {
+        glm::vec3 const origin{3.0f * unit(random), 3.0f * unit(random), 3.0f * unit(random)};
+        auto const towards = glm::vec3{unit(random), unit(random), unit(random)} - origin;
+        LinePacket lines{origin, {}};
+        for (unsigned j = 0; j < LINE_PACKET_SIZE; ++j) {
+            lines.directions.insert(j, towards + 0.2f * glm::vec3{unit(random), unit(random), unit(random)});
+        }
+        packets.push_back(lines);
+    }
+    return packets;
+}
+
+
+// Packets of axis-aligned lines along the planes of a grid, starting inside and outside it.
+static std::vector<LinePacket> gridLinePackets(unsigned size) {
+    auto const directions = axisDirections();
+    std::vector<float> coords;
+    for (int i = -2; i <= 2 * static_cast<int>(size) + 2; ++i) {
+        coords.push_back(i / 2.0f);
+    }
+    std::vector<LinePacket> packets;
+    for (auto const x : coords) {
+        for (auto const y : coords) {
+            for (auto const z : coords) {
+                for (std::size_t first = 0; first < directions.size(); first += LINE_PACKET_SIZE) {
+                    LinePacket lines{{x, y, z}, {}};
+                    for (unsigned i = 0; i < LINE_PACKET_SIZE; ++i) {
+                        lines.directions.insert(i, directions[(first + i) % directions.size()]);
+                    }
+                    packets.push_back(lines);
+                }
+            }
+        }
+    }
+    return packets;
+}
+
+
+// Lines start on the tris of some tests, where intersections at t = 0 are ambiguous, so like the renderer, the tests
+// only consider intersections a little way along lines.
+constexpr float T_MIN = 1e-3f;
+
+
+// Compares a tree's nearest intersections, packet nearest intersections and occlusion with brute force, including
+// with parameter ranges ending just before the nearest intersection.
+static bool testAgainstBruteForce(TestMesh const& mesh, MeshTreeType type, std::string const& name,
+        std::vector<LinePacket> const& packets) {
+    auto const tree = mesh.tree(type);
+    std::size_t hits = 0;
+    std::size_t nearestMismatches = 0;
+    std::size_t occludedMismatches = 0;
+    std::size_t packetMismatches = 0;
+    for (auto const& lines : packets) {
+        std::array<std::optional<LineTriIntersection>, LINE_PACKET_SIZE> expected;
+        FVec8 tMaxs{INFINITY};
+        for (unsigned i = 0; i < LINE_PACKET_SIZE; ++i) {
+            auto const line = lines.line(i);
+            expected[i] = mesh.nearestIntersection(line, T_MIN);
+            hits += expected[i].has_value();
+            if (!sameIntersection(tree.lineTriNearestIntersection<SurfaceConsideration::ALL>(line, T_MIN, INFINITY),
+                    expected[i])) {
+                ++nearestMismatches;
+            }
+            if (tree.occluded<SurfaceConsideration::ALL>(line, T_MIN, INFINITY) != expected[i].has_value()) {
+                ++occludedMismatches;
+            }
+            if (expected[i]) {
+                auto const tBefore = 0.99f * expected[i]->t;
+                if (tree.lineTriNearestIntersection<SurfaceConsideration::ALL>(line, T_MIN, tBefore)) {
+                    ++nearestMismatches;
+                }
+                if (tree.occluded<SurfaceConsideration::ALL>(line, T_MIN, tBefore)) {
+                    ++occludedMismatches;
+                }
+                // Every other line of the packet is bounded just before its nearest intersection.
+                if (i % 2 == 1) {
+                    tMaxs[i] = tBefore;
+                    expected[i] = std::nullopt;
+                }
+            }
+        }
+        auto const intersections = tree.lineTriNearestIntersections<SurfaceConsideration::ALL>(lines, T_MIN, tMaxs);
+        for (unsigned i = 0; i < LINE_PACKET_SIZE; ++i) {
+            if (!sameIntersection(intersections[i], expected[i])) {
+                ++packetMismatches;
+            }
+        }
+    }
+    auto passed = check(hits > 0, name + ": some lines intersect the mesh");
+    passed &= check(nearestMismatches == 0,
+        name + ": " + std::to_string(nearestMismatches) + " nearest intersections differ from brute force");
+    passed &= check(occludedMismatches == 0,
+        name + ": " + std::to_string(occludedMismatches) + " occlusions differ from brute force");
+    passed &= check(packetMismatches == 0,
+        name + ": " + std::to_string(packetMismatches) + " packet intersections differ from brute force");
+    return passed;
+}
+
+
+int main() {
+    std::mt19937 random{1};
+    auto const randomPackets = randomLinePackets(random, 100);
+
+    auto const soup = randomMesh(random, 2000, 0.1f);
+
+    // Lines lying in a box face plane have a plane distance of 0 * infinity = NaN, which used to cull the box.
+    constexpr unsigned GRID_SIZE = 4;
+    auto const grid = gridMesh(GRID_SIZE);
+    auto const gridPackets = gridLinePackets(GRID_SIZE);
+
+    // Copies of one tri can't be separated, so BVH builds must fall back to median splits, and BSP builds must stop
+    // dividing. Some other tris give the builds something to separate them from.
+    auto coincident = randomMesh(random, 100, 0.1f);
+    for (unsigned i = 0; i < 3000; ++i) {
+        coincident.addTri({-0.5f, -0.5f, 0.0f}, {0.5f, -0.5f, 0.0f}, {0.0f, 0.5f, 0.0f});
+    }
+    coincident.preprocess();
+
+    // Huge tris which all overlap can't be separated by object splits, and spatial splits would duplicate every tri
+    // into both children, so the SBVH duplication budget must stop it.
+    auto const overlapping = randomMesh(random, 1000, 10.0f);
+
+    auto passed = true;
+    for (auto const& [type, name] : MESH_TREE_TYPE_NAMES) {
+        auto const typeName = std::string{name};
+        passed &= testAgainstBruteForce(soup, type, typeName + " random tris", randomPackets);
+        passed &= testAgainstBruteForce(grid, type, typeName + " grid", gridPackets);
+        passed &= testAgainstBruteForce(coincident, type, typeName + " coincident tris", randomPackets);
+        passed &= testAgainstBruteForce(overlapping, type, typeName + " huge overlapping tris", randomPackets);
+    }
+
+    // Tri indices used to be 16 bits.
+    auto const large = randomMesh(random, 70000, 0.01f);
+    passed &= testAgainstBruteForce(large, MeshTreeType::LBVH, "lbvh over 65535 tris", randomPackets);
+
+    if (passed) {
+        std::cout << "All tests passed" << std::endl;
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
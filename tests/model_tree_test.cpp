@@ -0,0 +1,170 @@
+#include "geometry.hpp"
+#include "index_types.hpp"
+#include "mesh.hpp"
+#include "mesh_tree.hpp"
+#include "model_tree.hpp"
+#include "utility/span.hpp"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <glm/gtc/matrix_inverse.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/mat4x3.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+
+static bool check(bool condition, std::string const& description) {
+    if (!condition) {
+        std::cerr << "FAILED: " << description << std::endl;
+    }
+    return condition;
+}
+
+
+constexpr float T_MIN = 1e-3f;
+
+
+struct TestScene {
+    std::vector<glm::vec3> vertexPositions;
+    std::vector<IndexedTri> tris;
+    std::vector<PreprocessedTri> preprocessedTris;
+    std::vector<MeshTree> meshTrees;
+    std::vector<MeshTransform> modelTransforms;
+    std::vector<MeshIndex> modelMeshes;
+
+    // Nearest intersection of any model, by searching each model's mesh tree in turn.
+    std::optional<float> nearestT(Line const& line) const {
+        std::optional<float> nearest;
+        for (std::size_t i = 0; i < modelTransforms.size(); ++i) {
+            glm::mat4x3 const worldToObject{glm::inverse(glm::mat4{modelTransforms[i].matrix()})};
+            Line const objectLine{
+                worldToObject * glm::vec4{line.origin, 1.0f},
+                worldToObject * glm::vec4{line.direction, 0.0f}
+            };
+            auto const intersection = meshTrees[modelMeshes[i]].lineTriNearestIntersection<SurfaceConsideration::ALL>(
+                objectLine, T_MIN, INFINITY);
+            if (intersection && (!nearest || intersection->t < *nearest)) {
+                nearest = intersection->t;
+            }
+        }
+        return nearest;
+    }
+};
+
+
+// Models of a few random meshes, scattered with random transforms.
+static TestScene randomScene(std::mt19937& random) {
+    std::uniform_real_distribution<float> unit{-1.0f, 1.0f};
+    auto const randomVec3 = [&random, &unit] {
+        return glm::vec3{unit(random), unit(random), unit(random)};
+    };
+
+    TestScene scene;
+    // One mesh per tree type.
+    constexpr unsigned MESH_COUNT = static_cast<unsigned>(MESH_TREE_TYPE_NAMES.size());
+    constexpr unsigned MESH_TRI_COUNT = 200;
+    for (unsigned i = 0; i < MESH_COUNT * MESH_TRI_COUNT; ++i) {
+        auto const centre = randomVec3();
+        auto const vertex = static_cast<VertexIndex>(scene.vertexPositions.size());
+        for (unsigned j = 0; j < 3; ++j) {
+            scene.vertexPositions.push_back(centre + 0.2f * randomVec3());
+        }
+        scene.tris.push_back({vertex, vertex + 1, vertex + 2});
+    }
+    for (auto const& tri : scene.tris) {
+        scene.preprocessedTris.push_back(preprocessTri({scene.vertexPositions[tri.v1], scene.vertexPositions[tri.v2],
+            scene.vertexPositions[tri.v3]}));
+    }
+    // Trees view their own storage, so mustn't be copied by reallocation.
+    scene.meshTrees.reserve(MESH_COUNT);
+    for (unsigned i = 0; i < MESH_COUNT; ++i) {
+        scene.meshTrees.emplace_back(MESH_TREE_TYPE_NAMES[i].first, readOnlySpan(scene.vertexPositions),
+            Span<IndexedTri const>{scene.tris.data() + i * MESH_TRI_COUNT, MESH_TRI_COUNT},
+            Span<PreprocessedTri const>{scene.preprocessedTris.data() + i * MESH_TRI_COUNT, MESH_TRI_COUNT});
+    }
+
+    constexpr unsigned MODEL_COUNT = 100;
+    for (unsigned i = 0; i < MODEL_COUNT; ++i) {
+        MeshTransform transform;
+        transform.position = 10.0f * randomVec3();
+        transform.orientation = glm::normalize(glm::quat{unit(random), unit(random), unit(random), unit(random)});
+        transform.scale = glm::vec3{1.5f} + randomVec3();
+        scene.modelTransforms.push_back(transform);
+        scene.modelMeshes.push_back(static_cast<MeshIndex>(i % MESH_COUNT));
+    }
+    return scene;
+}
+
+
+// Compares the model tree's intersections with searching every model, for lines from random points towards the
+// scene.
+static bool testRandomScene() {
+    std::mt19937 random{1};
+    std::uniform_real_distribution<float> unit{-1.0f, 1.0f};
+    auto const scene = randomScene(random);
+    ModelTree const tree{readOnlySpan(scene.meshTrees), readOnlySpan(scene.modelTransforms),
+        readOnlySpan(scene.modelMeshes)};
+
+    std::size_t hits = 0;
+    std::size_t nearestMismatches = 0;
+    std::size_t occludedMismatches = 0;
+    std::size_t packetMismatches = 0;
+    constexpr unsigned PACKET_COUNT = 500;
+    for (unsigned i = 0; i < PACKET_COUNT; ++i) {
+        glm::vec3 const origin{15.0f * unit(random), 15.0f * unit(random), 15.0f * unit(random)};
+        auto const towards = glm::vec3{5.0f * unit(random), 5.0f * unit(random), 5.0f * unit(random)} - origin;
+        LinePacket lines{origin, {}};
+        for (unsigned j = 0; j < LINE_PACKET_SIZE; ++j) {
+            lines.directions.insert(j, towards + glm::vec3{unit(random), unit(random), unit(random)});
+        }
+
+        auto const packetIntersections = tree.lineTriNearestIntersections<SurfaceConsideration::ALL>(lines, T_MIN);
+        for (unsigned j = 0; j < LINE_PACKET_SIZE; ++j) {
+            auto const line = lines.line(j);
+            auto const expected = scene.nearestT(line);
+            hits += expected.has_value();
+            auto const intersection = tree.lineTriNearestIntersection<SurfaceConsideration::ALL>(line, T_MIN);
+            if (intersection.has_value() != expected.has_value() || (intersection && intersection->t != *expected)) {
+                ++nearestMismatches;
+            }
+            // Packet directions are transformed to object space with slightly different rounding.
+            auto const& packetIntersection = packetIntersections[j];
+            if (packetIntersection.has_value() != expected.has_value()
+                    || (packetIntersection && std::abs(packetIntersection->t - *expected) > 1e-5f * *expected)) {
+                ++packetMismatches;
+            }
+            if (tree.occluded<SurfaceConsideration::ALL>(line, T_MIN, INFINITY) != expected.has_value()) {
+                ++occludedMismatches;
+            }
+            // Nothing is nearer than the nearest intersection.
+            if (expected && tree.occluded<SurfaceConsideration::ALL>(line, T_MIN, 0.99f * *expected)) {
+                ++occludedMismatches;
+            }
+        }
+    }
+    auto passed = check(hits > 0, "some lines intersect the scene");
+    passed &= check(nearestMismatches == 0,
+        std::to_string(nearestMismatches) + " nearest intersections differ from searching every model");
+    passed &= check(occludedMismatches == 0,
+        std::to_string(occludedMismatches) + " occlusions differ from searching every model");
+    passed &= check(packetMismatches == 0,
+        std::to_string(packetMismatches) + " packet intersections differ from searching every model");
+    return passed;
+}
+
+
+int main() {
+    auto const passed = testRandomScene();
+    if (passed) {
+        std::cout << "All tests passed" << std::endl;
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
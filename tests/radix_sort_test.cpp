@@ -0,0 +1,76 @@
+#include "utility/radix_sort.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+
+static bool check(bool condition, std::string const& description) {
+    if (!condition) {
+        std::cerr << "FAILED: " << description << std::endl;
+    }
+    return condition;
+}
+
+
+template<typename Key>
+struct Element {
+    Key key;
+    std::size_t index;      // Original position, to check stability.
+};
+
+
+// Sorts random keys with both radix sorts and checks the results match std::stable_sort(). Keys are masked so that
+// some digits are the same for all elements, and there are many equal keys.
+template<typename Key>
+static bool testSort(std::size_t elementCount, Key keyMask, std::vector<Element<Key>>& scratch,
+        std::mt19937_64& random) {
+    std::vector<Element<Key>> elements;
+    for (std::size_t i = 0; i < elementCount; ++i) {
+        elements.push_back({static_cast<Key>(random()) & keyMask, i});
+    }
+    auto expected = elements;
+    std::stable_sort(expected.begin(), expected.end(), [](auto const& a, auto const& b) { return a.key < b.key; });
+
+    auto const getKey = [](Element<Key> const& element) { return element.key; };
+    auto const sameAsExpected = [&expected](std::vector<Element<Key>> const& sorted) {
+        return std::equal(sorted.cbegin(), sorted.cend(), expected.cbegin(), expected.cend(),
+            [](auto const& a, auto const& b) { return a.key == b.key && a.index == b.index; });
+    };
+    auto const description = std::to_string(elementCount) + " elements with " + std::to_string(sizeof(Key) * 8)
+        + "-bit keys masked by " + std::to_string(keyMask) + " are sorted stably";
+
+    auto parallelSorted = elements;
+    parallelRadixSort(parallelSorted, getKey);
+    auto passed = check(sameAsExpected(parallelSorted), "parallel: " + description);
+
+    auto serialSorted = elements;
+    radixSort(serialSorted, scratch, getKey);
+    passed &= check(sameAsExpected(serialSorted), "serial: " + description);
+    return passed;
+}
+
+
+int main() {
+    std::mt19937_64 random{1};
+    // Scratch buffers are reused between serial sorts, as by the wavefront tracer.
+    std::vector<Element<std::uint32_t>> scratch32;
+    std::vector<Element<std::uint64_t>> scratch64;
+    auto passed = true;
+    // Large counts are divided into several chunks by the parallel sort.
+    for (std::size_t const count : {0, 1, 2, 1000, 100000, 300000}) {
+        passed &= testSort<std::uint32_t>(count, 0xFFFFFFFF, scratch32, random);
+        passed &= testSort<std::uint32_t>(count, 0x00FF0F00, scratch32, random);
+        passed &= testSort<std::uint64_t>(count, 0xFFFFFFFFFFFFFFFF, scratch64, random);
+        passed &= testSort<std::uint64_t>(count, 0xF0000000000000FF, scratch64, random);
+    }
+    if (passed) {
+        std::cout << "All tests passed" << std::endl;
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
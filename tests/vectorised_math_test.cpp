@@ -0,0 +1,133 @@
+#include "utility/vectorised.hpp"
+#include "utility/vectorised_math.hpp"
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+
+static bool check(bool condition, std::string const& description) {
+    if (!condition) {
+        std::cerr << "FAILED: " << description << std::endl;
+    }
+    return condition;
+}
+
+
+constexpr double EPSILON = 0x1p-23;
+
+
+// Checks every element of the FVec4 and FVec8 versions of a function equals its reference version, and that the
+// reference version is within the documented error of the double precision result.
+template<typename VectorFunction, typename ReferenceFunction, typename ExactFunction, typename MaxError>
+static bool testFunction(std::string const& name, std::vector<float> const& inputs, VectorFunction vectorFunction,
+        ReferenceFunction referenceFunction, ExactFunction exactFunction, MaxError maxError) {
+    std::size_t mismatches = 0;
+    std::size_t errors = 0;
+    for (std::size_t i = 0; i < inputs.size(); i += 8) {
+        std::array<float, 8> v;
+        for (std::size_t j = 0; j < 8; ++j) {
+            v[j] = inputs[(i + j) % inputs.size()];
+        }
+        auto const result4 = vectorFunction(FVec4{v[0], v[1], v[2], v[3]});
+        auto const result8 = vectorFunction(FVec8{v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]});
+        for (unsigned j = 0; j < 8; ++j) {
+            auto const reference = referenceFunction(v[j]);
+            if (result8[j] != reference || (j < 4 && result4[j] != reference)) {
+                ++mismatches;
+            }
+            auto const exact = exactFunction(static_cast<double>(v[j]));
+            if (!(std::abs(reference - exact) <= maxError(static_cast<double>(v[j]), exact))) {
+                ++errors;
+            }
+        }
+    }
+    auto passed = check(mismatches == 0, name + ": " + std::to_string(mismatches) + " vectorised results differ");
+    passed &= check(errors == 0, name + ": " + std::to_string(errors) + " results exceed the documented error");
+    return passed;
+}
+
+
+// Uniformly distributed in [min, max], including the bounds.
+static std::vector<float> uniformInputs(float min, float max, std::mt19937& random) {
+    std::uniform_real_distribution<float> distribution{min, max};
+    std::vector<float> inputs{min, max};
+    for (unsigned i = 0; i < 100000; ++i) {
+        inputs.push_back(distribution(random));
+    }
+    return inputs;
+}
+
+
+// Logarithmically distributed in [2^minExponent, 2^maxExponent), with both signs if negative is set.
+static std::vector<float> logarithmicInputs(int minExponent, int maxExponent, bool negative, std::mt19937& random) {
+    std::uniform_real_distribution<float> distribution{static_cast<float>(minExponent),
+        static_cast<float>(maxExponent)};
+    std::vector<float> inputs{std::ldexp(1.0f, minExponent), std::nextafter(std::ldexp(1.0f, maxExponent), 0.0f)};
+    for (unsigned i = 0; i < 100000; ++i) {
+        auto const v = std::min(std::exp2(distribution(random)), inputs[1]);
+        inputs.push_back(negative && i % 2 == 1 ? -v : v);
+    }
+    return inputs;
+}
+
+
+int main() {
+    std::mt19937 random{1};
+    auto const absoluteError = [](double maxError) {
+        return [maxError](double, double) { return maxError; };
+    };
+    auto const relativeError = [](double maxError) {
+        return [maxError](double, double exact) { return maxError * std::abs(exact); };
+    };
+
+    auto passed = true;
+
+    auto const angles = uniformInputs(-8192.0f, 8192.0f, random);
+    passed &= testFunction("sinCos().first", angles, [](auto v) { return sinCos(v).first; },
+        [](float v) { return sinCosReference(v).first; }, [](double v) { return std::sin(v); },
+        absoluteError(EPSILON));
+    passed &= testFunction("sinCos().second", angles, [](auto v) { return sinCos(v).second; },
+        [](float v) { return sinCosReference(v).second; }, [](double v) { return std::cos(v); },
+        absoluteError(EPSILON));
+    passed &= testFunction("sin()", angles, [](auto v) { return sin(v); }, sinReference,
+        [](double v) { return std::sin(v); }, absoluteError(EPSILON));
+    passed &= testFunction("cos()", angles, [](auto v) { return cos(v); }, cosReference,
+        [](double v) { return std::cos(v); }, absoluteError(EPSILON));
+
+    passed &= testFunction("exp()", uniformInputs(-87.0f, 88.0f, random), [](auto v) { return exp(v); },
+        expReference, [](double v) { return std::exp(v); }, relativeError(2.0 * EPSILON));
+
+    passed &= testFunction("log()", logarithmicInputs(-126, 128, false, random), [](auto v) { return log(v); },
+        logReference, [](double v) { return std::log(v); },
+        [](double v, double exact) { return v >= 0.5 && v <= 2.0 ? EPSILON : EPSILON * std::abs(exact); });
+
+    auto const bases = logarithmicInputs(-10, 10, false, random);
+    for (auto const exponent : {-3.5f, -1.0f, 0.5f, 2.2f, 8.0f}) {
+        passed &= testFunction("pow() with exponent " + std::to_string(exponent), bases,
+            [exponent](auto v) { return pow(v, decltype(v){exponent}); },
+            [exponent](float v) { return powReference(v, exponent); },
+            [exponent](double v) { return std::pow(v, static_cast<double>(exponent)); },
+            [exponent](double v, double exact) {
+                return (2.0 * EPSILON + std::abs(exponent * std::log(v)) * EPSILON) * std::abs(exact);
+            });
+    }
+
+    passed &= testFunction("reciprocal()", logarithmicInputs(-126, 126, true, random),
+        [](auto v) { return reciprocal(v); }, reciprocalReference, [](double v) { return 1.0 / v; },
+        relativeError(2.0 * EPSILON));
+
+    passed &= testFunction("rsqrt()", logarithmicInputs(-126, 128, false, random), [](auto v) { return rsqrt(v); },
+        rsqrtReference, [](double v) { return 1.0 / std::sqrt(v); }, relativeError(3.0 * EPSILON));
+
+    if (passed) {
+        std::cout << "All tests passed" << std::endl;
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}